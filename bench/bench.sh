@@ -0,0 +1,80 @@
+#!/bin/sh
+# end-to-end benchmark of maga-csv against gawk's FPAT.
+#
+# builds reproducible corpora with gencsv in $BENCH_DATA (bench/data) and
+# runs a field counting program over each with both parsers.  prints one
+# tab separated line per corpus, size and parser; for the "open" corpus
+# rows are files, so rows_per_s is files opened per second.
+#
+#   BENCH_ROWS   row counts to test, default "10000 100000 1000000"
+#   BENCH_KINDS  corpora, default all kinds gencsv knows
+#   BENCH_FILES  small files for the open overhead test, default 1000
+#   GAWK         gawk binary, default gawk
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$bench")
+data=${BENCH_DATA:-$bench/data}
+rows_list=${BENCH_ROWS:-"10000 100000 1000000"}
+kinds=${BENCH_KINDS:-"narrow wide quoted multiline utf8 crlf"}
+files=${BENCH_FILES:-1000}
+gawk=${GAWK:-gawk}
+
+if ! command -v "$gawk" >/dev/null 2>&1; then
+  echo "bench: $gawk not found, set GAWK" >&2
+  exit 1
+fi
+
+count='{ n += NF } END { print n }'
+fpat='BEGIN { FPAT = "([^,]*)|(\"([^\"]|\"\")*\")" }'
+
+# run PARSER FILES... and print seconds and peak RSS
+run () {
+  parser=$1
+  shift
+  if [ "$parser" = maga-csv ]; then
+    AWKLIBPATH=$root "$bench/measure" "$gawk" -l maga-csv \
+      "BEGIN { FS = \"\\031\" } $count" "$@"
+  else
+    "$bench/measure" "$gawk" "$fpat $count" "$@"
+  fi
+}
+
+# report CORPUS ROWS BYTES PARSER SECONDS RSS
+report () {
+  awk -v c="$1" -v r="$2" -v b="$3" -v p="$4" -v s="$5" -v m="$6" 'BEGIN {
+    printf "%s\t%d\t%d\t%s\t%.4f\t%.2f\t%.0f\t%d\n",
+      c, r, b, p, s, b / 1048576 / s, r / s, m
+  }'
+}
+
+mkdir -p "$data"
+printf 'corpus\trows\tbytes\tparser\tseconds\tmb_per_s\trows_per_s\tmax_rss_kb\n'
+
+for kind in $kinds; do
+  for rows in $rows_list; do
+    file=$data/$kind-$rows.csv
+    [ -f "$file" ] || "$bench/gencsv" "$kind" "$rows" > "$file"
+    bytes=$(wc -c < "$file")
+    for parser in maga-csv fpat; do
+      set -- $(run $parser "$file")
+      report "$kind" "$rows" "$bytes" $parser "$1" "$2"
+    done
+  done
+done
+
+# per file overhead: many one row files in a single gawk run
+dir=$data/open-$files
+if [ ! -d "$dir" ]; then
+  mkdir -p "$dir"
+  i=0
+  while [ $i -lt "$files" ]; do
+    "$bench/gencsv" narrow 1 $((i + 1)) > "$dir/$i.csv"
+    i=$((i + 1))
+  done
+fi
+bytes=$(cat "$dir"/*.csv | wc -c)
+for parser in maga-csv fpat; do
+  set -- $(run $parser "$dir"/*.csv)
+  report open "$files" "$bytes" $parser "$1" "$2"
+done
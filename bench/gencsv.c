@@ -0,0 +1,186 @@
+/*
+ * gencsv - write a synthetic CSV corpus for the maga-csv benchmark.
+ *
+ * usage: gencsv KIND ROWS [SEED]
+ *
+ * the output only depends on its arguments, so corpora can be rebuilt
+ * anywhere.  kinds:
+ *   narrow     8 short columns
+ *   wide       500 numeric columns
+ *   quoted     10 quoted columns with delimiters and "" inside
+ *   multiline  5 columns, one of them spanning several lines
+ *   utf8       4 columns with long multibyte text
+ *   crlf       like narrow, with \r\n line ends
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t state;
+
+static uint64_t
+next (void)
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned
+below (unsigned n)
+{
+  return next () % n;
+}
+
+static const char *words[] = {
+  "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+  "hotel", "india", "juliett", "kilo", "lima", "mike", "november",
+};
+
+static const char *utf8_words[] = {
+  "Grüße", "naïve", "façade", "smørrebrød", "Ελληνικά", "русский",
+  "日本語", "中文", "한국어", "עברית", "emoji😀", "ℝ²→ℂ",
+};
+
+#define COUNT(a) (sizeof (a) / sizeof ((a)[0]))
+
+/*
+ * random values are drawn into locals first, the order in which printf
+ * arguments are evaluated is unspecified.
+ */
+static const char *
+word (void)
+{
+  return words[below (COUNT (words))];
+}
+
+static void
+narrow_row (unsigned long row, const char *eol)
+{
+  const char *name = word ();
+  const unsigned whole = below (100000);
+  const unsigned cents = below (100);
+  const unsigned month = 1 + below (12);
+  const unsigned day = 1 + below (28);
+  const char *city = word ();
+  const unsigned count = below (1000);
+  const char grade = 'A' + below (26);
+  const unsigned flag = below (2);
+  printf ("%lu,%s,%u.%02u,2024-%02u-%02u,%s,%u,%c,%u%s", row, name, whole,
+	  cents, month, day, city, count, grade, flag, eol);
+}
+
+static void
+wide_row (unsigned long row)
+{
+  printf ("%lu", row);
+  for (int i = 1; i < 500; i++)
+    {
+      printf (",%u", below (100000));
+    }
+  putchar ('\n');
+}
+
+static void
+quoted_row (unsigned long row)
+{
+  for (int i = 0; i < 10; i++)
+    {
+      switch (below (3))
+	{
+	case 0:
+	  {
+	    const char *first = word ();
+	    printf ("\"%s, %s\"", first, word ());
+	  }
+	  break;
+	case 1:
+	  printf ("\"say \"\"%s\"\"\"", word ());
+	  break;
+	default:
+	  printf ("\"%lu\"", row * 10 + i);
+	  break;
+	}
+      putchar (i < 9 ? ',' : '\n');
+    }
+}
+
+static void
+multiline_row (unsigned long row)
+{
+  printf ("%lu,%s,\"", row, word ());
+  const unsigned lines = 1 + below (4);
+  for (unsigned i = 0; i < lines; i++)
+    {
+      const char *first = word ();
+      printf ("%s %s%s", first, word (), i + 1 < lines ? "\n" : "");
+    }
+  const unsigned count = below (1000);
+  printf ("\",%u,%s\n", count, word ());
+}
+
+static void
+utf8_row (unsigned long row)
+{
+  printf ("%lu", row);
+  for (int i = 0; i < 3; i++)
+    {
+      putchar (',');
+      const unsigned count = 10 + below (30);
+      for (unsigned j = 0; j < count; j++)
+	{
+	  printf ("%s%s", j > 0 ? " " : "",
+		  utf8_words[below (COUNT (utf8_words))]);
+	}
+    }
+  putchar ('\n');
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 3)
+    {
+      fprintf (stderr, "usage: %s KIND ROWS [SEED]\n", argv[0]);
+      return 2;
+    }
+  const char *kind = argv[1];
+  const unsigned long rows = strtoul (argv[2], NULL, 10);
+  state = (argc > 3 ? strtoull (argv[3], NULL, 10) : 42) | 1;
+
+  for (unsigned long row = 0; row < rows; row++)
+    {
+      if (strcmp (kind, "narrow") == 0)
+	{
+	  narrow_row (row, "\n");
+	}
+      else if (strcmp (kind, "crlf") == 0)
+	{
+	  narrow_row (row, "\r\n");
+	}
+      else if (strcmp (kind, "wide") == 0)
+	{
+	  wide_row (row);
+	}
+      else if (strcmp (kind, "quoted") == 0)
+	{
+	  quoted_row (row);
+	}
+      else if (strcmp (kind, "multiline") == 0)
+	{
+	  multiline_row (row);
+	}
+      else if (strcmp (kind, "utf8") == 0)
+	{
+	  utf8_row (row);
+	}
+      else
+	{
+	  fprintf (stderr, "%s: unknown kind %s\n", argv[0], kind);
+	  return 2;
+	}
+    }
+  return 0;
+}
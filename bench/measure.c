@@ -0,0 +1,58 @@
+/*
+ * measure - run a command with its output discarded and print its wall
+ * time in seconds and its peak resident set size in KB.
+ *
+ * usage: measure COMMAND [ARGS...]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s COMMAND [ARGS...]\n", argv[0]);
+      return 2;
+    }
+
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  const pid_t pid = fork ();
+  if (pid < 0)
+    {
+      perror ("fork");
+      return 1;
+    }
+  if (pid == 0)
+    {
+      const int null = open ("/dev/null", O_WRONLY);
+      dup2 (null, STDOUT_FILENO);
+      execvp (argv[1], argv + 1);
+      perror (argv[1]);
+      _exit (127);
+    }
+
+  int status;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) < 0)
+    {
+      perror ("wait4");
+      return 1;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      fprintf (stderr, "%s: %s failed\n", argv[0], argv[1]);
+      return 1;
+    }
+
+  printf ("%.6f %ld\n", (end.tv_sec - start.tv_sec)
+	  + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss);
+  return 0;
+}
@@ -2,68 +2,464 @@
  * gawk csv parser
  * (part of the 'make awk great again' project)
  *
- * this extension parses CSV files natively (libcsv) without using FPAT.
+ * this extension parses CSV files natively without using FPAT.
  * in our tests this has reduced runtime considerably (approx 20x).
  * currently this extension requires FS to be set to "\31".
  *
- * internally it uses a queue of row buffers to convert the output of
- * libcsv to the gawk format.
+ * records are found by a vectorized scanner (SSE4.2, AVX2 or AVX-512,
+ * picked at load time, with a scalar fallback) and converted to the
+ * gawk format through a queue of row buffers.  regular files are
+ * mapped into memory and parsed in place, everything else is read().
  */
 
-#include <csv.h>
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MAGA_CSV_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MAGA_CSV_X86 1
+#include <immintrin.h>
+#endif
 
 #include "gawkapi.h"
 
+/*
+ * gawk 4.2 and later take the field boundaries along with a record and
+ * do not split it by FS again.  the bundled older header cannot.
+ */
+#ifdef awk_fieldwidth_info_size
+#define MAGA_CSV_WIDTHS
+#endif
+
 #define READ_SZ (1024 * 1024)
-#define ROW_INITIAL_CAPACITY (100)
+#define PIPE_SZ (1024 * 1024)
+#define SCAN_WINDOW (64 * 1024)
+#define ROW_SLAB_SZ (256 * 1024)
+#define ROW_QUEUE_INITIAL_CAPACITY (64)
+#define PIPELINE_BATCHES (4)
+#define PIPELINE_BATCH_ROWS (1024)
+#define QUEUE_ROWS (1024)
+#define QUEUE_BYTES (1024 * 1024)
+#define PIPELINE_MAX_THREADS (64)
+#define SEGMENT_SZ (4 * 1024 * 1024)
+#define URING_DEPTH (4)
+#define URING_BUF_SZ (256 * 1024)
+#define OUTPUT_SZ (1024 * 1024)
+#define INFLATE_BLOCKS (4)
+#define INFLATE_BLOCK_SZ (1024 * 1024)
+#define INFLATE_INPUT_SZ (256 * 1024)
+#define SIDECAR_INTERVAL (4096)
+#define SHARD_PROBE_SZ (64 * 1024)
+#define SIDECAR_SUFFIX ".mcsvidx"
+#define CSV_DELIM ','
+#define CSV_QUOTE '"'
 static /*const */ char RT_START = '\31';
 static const int RT_LEN = 1;
 
 /* Boilerplate code: */
 int plugin_is_GPL_compatible;
 
+/* row text lives in the input buffer or in a row_arena, never on its own */
 typedef struct row
 {
-  size_t capacity;
   size_t length;
   char *text;
+#ifdef MAGA_CSV_WIDTHS
+  uint32_t *widths;		/* widths[0] fields of widths[1...] bytes */
+#endif
 } row_t;
 
+/*
+ * ring of parsed rows that have not been handed to gawk yet.  it starts
+ * small and doubles when full, capacity is always a power of two.
+ */
 struct row_queue
 {
   size_t begin;
-  size_t end;
-  row_t rows[READ_SZ];
+  size_t count;
+  size_t capacity;
+  size_t high_water;		/* most rows ever queued at once */
+  size_t bytes;			/* text of the queued rows */
+  row_t *rows;
+};
+
+struct row_slab
+{
+  struct row_slab *next;
+  size_t size;
+  size_t used;
+  char text[];
+};
+
+/*
+ * rows built from quoted records are carved from a list of slabs.  the
+ * arena is reset instead of freeing rows, once the row queue has drained
+ * and gawk holds its own copy of the last record, so the slabs are
+ * reused for the rest of the input.
+ */
+struct row_arena
+{
+  struct row_slab *first;
+  struct row_slab *current;
+  size_t slabs;			/* slabs allocated so far */
+};
+
+/* what the parser did with an input, reported by csv_stats() */
+struct csv_stats
+{
+  size_t bytes;			/* input read or mapped */
+  size_t reads;			/* calls to read input */
+  size_t records;		/* found, including dropped ones */
+  size_t fields;		/* of the rows handed on */
+  size_t quoted;		/* of those fields, with quotes or escapes */
+  size_t grows;			/* buffers, rings and slabs allocated */
+  size_t high_water;		/* most rows queued at once */
+  uint64_t read_ns;		/* waiting for input */
+  uint64_t parse_ns;		/* everything else in csv_parse_batch */
+  size_t invalid;		/* invalid UTF-8 sequences in rows */
+};
+
+/* rows parsed from the input and the storage of their text */
+struct csv_batch
+{
+  struct row_queue *row_queue;
+  struct row_arena arena;
+  int error;			/* errno of a failed read, ends the input */
+  bool eof;			/* last batch of the input or of a segment */
+  size_t segment;		/* segment the rows were parsed from */
+  bool parity;			/* odd number of quotes in that segment */
+  struct csv_stats stats;	/* of the producer while filling the batch */
+  struct group_table *groups;	/* of its rows, per aggregation, or NULL */
+  size_t group_count;
+};
+
+/*
+ * single producer, single consumer ring of batches.  head is only written
+ * by the consumer and tail only by the producer; the semaphore counts the
+ * filled slots so an empty ring can be waited on without spinning.
+ */
+struct batch_ring
+{
+  atomic_size_t head;
+  atomic_size_t tail;
+  sem_t filled;
+  struct csv_batch *slots[PIPELINE_BATCHES];
+};
+
+/*
+ * a worker thread parses ahead into a fixed set of batches.  full
+ * batches travel to gawk's thread through the ready ring and come back
+ * through the free ring once gawk has copied every record of them.
+ */
+struct csv_worker
+{
+  pthread_t thread;
+  size_t id;
+  struct csv_state *state;	/* parse state owned by this worker */
+  struct csv_pipeline *pipeline;
+  struct csv_batch batches[PIPELINE_BATCHES];
+  struct batch_ring ready;
+  struct batch_ring free;
+  struct csv_stats seen;	/* of the batches gawk took */
+};
+
+/*
+ * with MAGA_CSV_THREADS=1 one worker reads and parses the input ahead of
+ * gawk.  with more threads a mapped file is cut into segments that the
+ * workers parse in turn, and gawk takes their batches in file order.
+ * a worker cannot know whether its segment starts inside a quoted field,
+ * so it assumes it does not and reports the quote parity of the segment.
+ * gawk's thread adds up the parities and parses a segment again itself
+ * if the guess was wrong.
+ */
+struct csv_pipeline
+{
+  size_t workers;
+  struct csv_worker *worker;
+  struct csv_batch *current;	/* batch gawk reads from */
+  size_t segments;		/* 0 unless the file is cut into segments */
+  size_t segment;		/* segment gawk reads from */
+  bool segment_start;		/* no batch of segment taken yet */
+  bool quoted;			/* segment starts inside a quoted field */
+  struct csv_batch fixup;	/* segment parsed again by gawk's thread */
+};
+
+/*
+ * the scanner writes the offsets of all quotes and of the delimiters and
+ * line breaks outside of quotes to index and returns their number.
+ * buf must start outside of a quoted field.  every quote toggles the
+ * quote state (an escaped "" toggles twice), so the vector kernels can
+ * find the quoted regions of 64 bytes at once with a prefix xor over
+ * the quote bitmask.
+ */
+struct csv_dialect;
+typedef size_t (*csv_scan_fn) (const struct csv_dialect * dialect,
+			       const char *buf, size_t len,
+			       uint32_t * index);
+
+/* how fields are delimited and quoted, set per input from awk */
+struct csv_dialect
+{
+  char delim;
+  char quote;
+  char escape;			/* same as quote when quotes are doubled */
+  csv_scan_fn scan;		/* kernel specialized for the above */
+};
+
+/* field names of the header record, pointing into its row */
+struct csv_header
+{
+  row_t *fields;
+  size_t count;
+};
+
+/* bytes and structural offsets of one field of a record */
+struct field_span
+{
+  size_t from;
+  size_t to;
+  size_t first;			/* index entries inside the field */
+  size_t last;
+};
+
+/* the fields kept of every record, from CSV_COLUMNS */
+struct csv_projection
+{
+  size_t *columns;		/* zero based, in output order */
+  size_t count;			/* 0 keeps all fields */
+  size_t needed;		/* fields to find, one past the largest */
+};
+
+enum csv_predicate_op
+{
+  PREDICATE_EQUAL,
+  PREDICATE_PREFIX,
+  PREDICATE_RANGE,
+  PREDICATE_IN,
+};
+
+/* a test on one field, registered with csv_filter() */
+struct csv_predicate
+{
+  enum csv_predicate_op op;
+  size_t column;		/* zero based input column */
+  char *name;			/* column name, NULL if given by number */
+  row_t *values;		/* strings to compare with */
+  size_t count;
+  double low;			/* inclusive bounds of PREDICATE_RANGE */
+  double high;
+};
+
+/* rows are only queued if all predicates hold */
+struct csv_filter
+{
+  struct csv_predicate *predicates;
+  size_t count;
+  size_t needed;		/* fields to find, one past the largest */
+};
+
+enum csv_group_op
+{
+  GROUP_COUNT = 1,
+  GROUP_SUM = 2,
+  GROUP_MIN = 4,
+  GROUP_MAX = 8,
+  GROUP_MEAN = 16,
+};
+
+/* the running totals of one group */
+struct group_entry
+{
+  uint64_t hash;
+  const char *key;
+  size_t length;
+  double count;
+  double sum;
+  double min;
+  double max;
+};
+
+/* a slot of a group_table, with the top half of the hash of its group */
+struct group_slot
+{
+  uint32_t check;
+  uint32_t entry;		/* index of the group plus one, 0 if free */
+};
+
+/*
+ * groups by key.  the groups are kept in the order they were found and
+ * an open addressing table with linear probing points at them, so the
+ * table stays small and growing it does not move the groups.  capacity
+ * is a power of two and at most half of it is used.  keys are kept in
+ * an arena that is never reset.
+ */
+struct group_table
+{
+  struct group_slot *slots;
+  size_t capacity;
+  struct group_entry *entries;
+  size_t count;
+  size_t size;			/* entries allocated */
+  struct row_arena keys;
+};
+
+/* an aggregation registered with csv_group_by() and its results */
+struct csv_aggregation
+{
+  char *keys;			/* columns, as for CSV_COLUMNS */
+  char *column;			/* of the values, NULL to only count */
+  unsigned ops;			/* csv_group_op bits to report */
+  struct group_table table;	/* of the inputs closed so far */
+};
+
+/* an aggregation applied to one input, with its columns looked up */
+struct csv_group
+{
+  size_t id;			/* index of the aggregation */
+  struct csv_projection keys;
+  size_t column;		/* SIZE_MAX to only count */
+  struct group_table table;
+};
+
+struct csv_groups
+{
+  struct csv_group *groups;
+  size_t count;
+  size_t needed;		/* fields to find, one past the largest */
+  size_t generation;		/* of the aggregations they were made from */
+  char *subsep;			/* joins the fields of a key */
+  size_t subsep_length;
+  char *key;			/* the key of the current row */
+  size_t key_size;
 };
 
-struct row_cb_data
+/* a row kept by reservoir sampling and its number among all rows */
+struct sample_row
 {
+  size_t ordinal;
   row_t row;
-  struct row_queue *rq;
+};
+
+/*
+ * a uniform sample of the rows of an input, kept with algorithm R and
+ * handed to gawk in input order once the input has ended.
+ */
+struct csv_sample
+{
+  size_t size;			/* rows to keep */
+  size_t seen;			/* rows offered so far */
+  uint64_t random;		/* xorshift state */
+  struct sample_row *rows;
+  bool flushed;
+};
+
+/*
+ * offsets of every SIDECAR_INTERVAL-th record of a mapped file, kept in
+ * a .mcsvidx file next to it with CSV_INDEX.  they are collected on a
+ * first pass over the file and let later passes start at any record,
+ * and segments start at exact record boundaries.
+ */
+struct csv_sidecar
+{
+  char *path;
+  off_t size;			/* of the file the offsets belong to */
+  struct timespec mtime;
+  uint64_t *offsets;		/* of records 0, SIDECAR_INTERVAL, ... */
+  size_t count;
+  size_t capacity;
+  size_t records;		/* in the whole file, once complete */
+  bool complete;		/* loaded, or built from a whole pass */
+};
+
+/* what CSV_UTF8 does with rows that are not valid UTF-8 */
+enum csv_utf8
+{
+  UTF8_OFF,
+  UTF8_PASS,			/* count the invalid sequences */
+  UTF8_REPLACE,			/* and replace them with U+FFFD */
+  UTF8_REJECT			/* end the input with EILSEQ */
 };
 
 struct csv_state
 {
-  struct csv_parser *parser;
-  char *read_buffer;
-  struct row_queue *row_queue;
-  struct row_cb_data rcbd;	/* row callback data */
-  char *rt_start;		/* row terminator */
-  int rt_len;			/* row terminator length */
-  char *out_to_free;		/* text buffer of previous iteration */
+  int fd;
+  char *buffer;			/* input bytes, records start at offset */
+  size_t capacity;
+  size_t length;
+  size_t offset;
+  size_t limit;			/* records starting here are left alone */
+  size_t begin;			/* first byte after the header */
+  bool eof;
+  bool mapped;			/* buffer is a mapping of the whole file */
+  bool stream;			/* fd is a pipe or socket read with read() */
+  uint32_t *index;		/* structural offsets of the current window */
+  size_t window;		/* bytes scanned at once, one index slot each */
+  size_t window_start;		/* of a window left with a full queue */
+  size_t window_length;
+  size_t window_count;		/* offsets found in it */
+  size_t window_next;		/* offset the next record starts after */
+  size_t paused;		/* state->offset when it was left */
+  size_t queue_rows;		/* a batch ends when this many are queued */
+  size_t queue_bytes;		/* or when their text is this long */
+  struct csv_uring *uring;	/* reads in flight, or NULL for read() */
+  struct csv_inflate *inflate;	/* decompressor, or NULL */
+#ifdef MAGA_CSV_WIDTHS
+  awk_fieldwidth_info_t *widths;	/* of the record handed to gawk */
+  size_t widths_size;		/* fields widths has room for */
+#endif
+  bool borrow;			/* rows may point into buffer */
+  struct csv_dialect dialect;
+  struct csv_projection projection;
+  struct csv_filter filter;
+  struct csv_groups groups;	/* from csv_group_by() */
+  bool discard;			/* aggregate rows without queueing them */
+  enum csv_utf8 utf8;
+  size_t needed;		/* fields of each record to find spans of */
+  struct field_span *spans;	/* scratch of each thread, needed long */
+  char *scratch;		/* unescaped field values for the filter */
+  size_t scratch_size;
+  size_t skip;			/* rows still to drop, from CSV_SKIP */
+  size_t rows_left;		/* rows still to pass, from CSV_LIMIT */
+  struct csv_sample *sample;	/* CSV_SAMPLE, or NULL */
+  struct csv_sidecar *sidecar;	/* CSV_INDEX, or NULL */
+  size_t record;		/* records found so far */
+  size_t mark;			/* next record to note the offset of */
+  struct csv_batch *batch;	/* where parsed rows go */
+  struct csv_pipeline *pipeline;
+  struct csv_stats stats;	/* written by whoever parses */
 };
 
 
@@ -71,241 +467,5021 @@ static const gawk_api_t *api;
 static awk_ext_id_t ext_id;
 static const char *ext_version = "1.0";
 
-static struct row_queue *
-row_queue_new ()
-{
-  struct row_queue *rq = gawk_malloc (sizeof (struct row_queue));
-  rq->begin = 0;
-  rq->end = 0;
-  memset (rq->rows, 0, READ_SZ * sizeof (row_t));
-  return rq;
-}
+/*
+ * the dialects that get kernels of their own, with the delimiter and
+ * quote folded into the compares.  any other dialect uses the "any"
+ * kernels, which read them from the dialect.
+ */
+#define SCAN_DIALECTS(X, isa)						\
+  X (isa, comma, ',', CSV_QUOTE)					\
+  X (isa, tab, '\t', CSV_QUOTE)						\
+  X (isa, semicolon, ';', CSV_QUOTE)					\
+  X (isa, pipe, '|', CSV_QUOTE)						\
+  X (isa, any, dialect->delim, dialect->quote)
 
-static void
-row_queue_destroy (struct row_queue *rq)
+static const char scan_delims[] = { ',', '\t', ';', '|' };
+
+/* kernels of the selected instruction set, in SCAN_DIALECTS order */
+static const csv_scan_fn *csv_scan_kernels;
+static const char *csv_scan_isa;
+
+static inline size_t
+scan_scalar_with (const char *buf, size_t len, uint32_t * index,
+		  const char delim, const char quote)
 {
-  // TODO: delete stuff inside...
-  free (rq);
+  size_t n = 0;
+  bool quoted = false;
+  for (size_t i = 0; i < len; i++)
+    {
+      const char c = buf[i];
+      if (c == quote)
+	{
+	  quoted = !quoted;
+	  index[n++] = i;
+	}
+      else if (!quoted && (c == delim || c == '\n' || c == '\r'))
+	{
+	  index[n++] = i;
+	}
+    }
+  return n;
 }
 
-static row_t
-row_queue_pop_front (struct row_queue *rq)
+#define DEFINE_SCAN_SCALAR(isa, name, delim, quote)			\
+  static size_t								\
+  scan_##isa##_##name (const struct csv_dialect *dialect,		\
+		       const char *buf, size_t len, uint32_t * index)	\
+  {									\
+    (void) dialect;							\
+    return scan_scalar_with (buf, len, index, delim, quote);		\
+  }
+
+SCAN_DIALECTS (DEFINE_SCAN_SCALAR, scalar)
+
+/*
+ * for an escape character other than the quote.  the escape and the byte
+ * after it are taken literally, inside quotes or not, so quotes no
+ * longer toggle by parity and only a scalar loop can follow them.  the
+ * escapes are indexed so row_build can drop them.
+ */
+static size_t
+scan_escaped (const struct csv_dialect *dialect, const char *buf,
+	      size_t len, uint32_t * index)
 {
-  row_t row = rq->rows[rq->begin];
-  rq->begin++;
-  assert (rq->begin <= READ_SZ);
-  if (rq->begin == READ_SZ)
+  size_t n = 0;
+  bool quoted = false;
+  for (size_t i = 0; i < len; i++)
     {
-      rq->begin = 0;
+      const char c = buf[i];
+      if (c == dialect->escape)
+	{
+	  index[n++] = i++;
+	}
+      else if (c == dialect->quote)
+	{
+	  quoted = !quoted;
+	  index[n++] = i;
+	}
+      else if (!quoted && (c == dialect->delim || c == '\n' || c == '\r'))
+	{
+	  index[n++] = i;
+	}
     }
-  return row;
+  return n;
 }
 
-static void
-row_queue_push_back (struct row_queue *rq, row_t * row)
+#ifdef MAGA_CSV_X86
+
+static inline size_t
+flatten_bits (uint32_t * index, size_t n, uint32_t base, uint64_t bits)
 {
-  //fprintf (stderr, "rq push\n");
-  rq->rows[rq->end] = *row;
-  rq->end++;
-  assert (rq->end <= READ_SZ);
-  if (rq->end == READ_SZ)
+  while (bits != 0)
     {
-      rq->end = 0;
+      index[n++] = base + __builtin_ctzll (bits);
+      bits &= bits - 1;
     }
-  //fprintf (stderr, "rq push end\n");
+  return n;
 }
 
-static bool
-row_queue_empty (struct row_queue *rq)
+__attribute__ ((target ("pclmul")))
+static inline uint64_t
+prefix_xor (uint64_t bits)
 {
-  return rq->begin == rq->end;
+  const __m128i all = _mm_set1_epi8 ((char) 0xff);
+  const __m128i x = _mm_set_epi64x (0, (long long) bits);
+  return (uint64_t) _mm_cvtsi128_si64 (_mm_clmulepi64_si128 (x, all, 0));
 }
 
-static row_t
-row_new (size_t capacity)
+__attribute__ ((target ("sse4.2")))
+static inline void
+block_masks_sse42 (const char *p, uint64_t * quotes, uint64_t * structs,
+		   const char delim, const char quote)
 {
-  assert (capacity > 0);
-  row_t rb = {
-    .capacity = capacity,
-    .length = 0,
-    .text = gawk_malloc (capacity)
-  };
-  //fprintf (stderr, "new row: %p\n", rb.text);
-  return rb;
+  const __m128i q = _mm_set1_epi8 (quote);
+  const __m128i d = _mm_set1_epi8 (delim);
+  const __m128i cr = _mm_set1_epi8 ('\r');
+  const __m128i lf = _mm_set1_epi8 ('\n');
+  *quotes = 0;
+  *structs = 0;
+  for (int k = 0; k < 4; k++)
+    {
+      const __m128i v = _mm_loadu_si128 ((const __m128i *) (p + 16 * k));
+      const __m128i s = _mm_or_si128 (_mm_cmpeq_epi8 (v, d),
+				      _mm_or_si128 (_mm_cmpeq_epi8 (v, cr),
+						    _mm_cmpeq_epi8 (v, lf)));
+      *quotes |= (uint64_t) (uint16_t)
+	_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, q)) << (16 * k);
+      *structs |= (uint64_t) (uint16_t) _mm_movemask_epi8 (s) << (16 * k);
+    }
 }
 
-static void
-row_append (row_t * rb, char *s, size_t len)
+__attribute__ ((target ("avx2")))
+static inline void
+block_masks_avx2 (const char *p, uint64_t * quotes, uint64_t * structs,
+		  const char delim, const char quote)
 {
-  if (rb->length + len > rb->capacity)
+  const __m256i q = _mm256_set1_epi8 (quote);
+  const __m256i d = _mm256_set1_epi8 (delim);
+  const __m256i cr = _mm256_set1_epi8 ('\r');
+  const __m256i lf = _mm256_set1_epi8 ('\n');
+  *quotes = 0;
+  *structs = 0;
+  for (int k = 0; k < 2; k++)
     {
-      const size_t new_capacity = MAX (len, rb->capacity) * 2;
-      rb->text = gawk_realloc (rb->text, new_capacity);
-      rb->capacity = new_capacity;
+      const __m256i v = _mm256_loadu_si256 ((const __m256i *) (p + 32 * k));
+      const __m256i s = _mm256_or_si256 (_mm256_cmpeq_epi8 (v, d),
+					 _mm256_or_si256 (_mm256_cmpeq_epi8
+							  (v, cr),
+							  _mm256_cmpeq_epi8
+							  (v, lf)));
+      *quotes |= (uint64_t) (uint32_t)
+	_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, q)) << (32 * k);
+      *structs |= (uint64_t) (uint32_t) _mm256_movemask_epi8 (s) << (32 * k);
     }
-  memcpy (rb->text + rb->length, s, len);
-  rb->length += len;
 }
 
+__attribute__ ((target ("avx512f,avx512bw")))
+static inline void
+block_masks_avx512 (const char *p, uint64_t * quotes, uint64_t * structs,
+		    const char delim, const char quote)
+{
+  const __m512i v = _mm512_loadu_si512 ((const void *) p);
+  *quotes = _mm512_cmpeq_epi8_mask (v, _mm512_set1_epi8 (quote));
+  *structs = _mm512_cmpeq_epi8_mask (v, _mm512_set1_epi8 (delim))
+    | _mm512_cmpeq_epi8_mask (v, _mm512_set1_epi8 ('\r'))
+    | _mm512_cmpeq_epi8_mask (v, _mm512_set1_epi8 ('\n'));
+}
+
+#define SCAN_TARGET_sse42 "sse4.2,pclmul"
+#define SCAN_TARGET_avx2 "avx2,pclmul"
+#define SCAN_TARGET_avx512 "avx512f,avx512bw,pclmul"
+
+/*
+ * one kernel per instruction set and dialect.  the tail of the buffer is
+ * copied to a zero padded block so the block loads never read past len.
+ */
+#define DEFINE_SCAN_KERNEL(isa, name, delim, quote)			\
+  __attribute__ ((target (SCAN_TARGET_##isa)))				\
+  static size_t								\
+  scan_##isa##_##name (const struct csv_dialect *dialect,		\
+		       const char *buf, size_t len, uint32_t * index)	\
+  {									\
+    (void) dialect;							\
+    char tail[64];							\
+    uint64_t carry = 0;							\
+    size_t n = 0;							\
+    for (size_t i = 0; i < len; i += 64)				\
+      {									\
+	const char *p = buf + i;					\
+	if (len - i < 64)						\
+	  {								\
+	    memset (tail, 0, sizeof (tail));				\
+	    memcpy (tail, p, len - i);					\
+	    p = tail;							\
+	  }								\
+	uint64_t quotes, structs;					\
+	block_masks_##isa (p, &quotes, &structs, delim, quote);		\
+	const uint64_t inside = prefix_xor (quotes) ^ carry;		\
+	carry = (uint64_t) ((int64_t) inside >> 63);			\
+	n = flatten_bits (index, n, i, quotes | (structs & ~inside));	\
+      }									\
+    return n;								\
+  }
+
+SCAN_DIALECTS (DEFINE_SCAN_KERNEL, sse42)
+SCAN_DIALECTS (DEFINE_SCAN_KERNEL, avx2)
+SCAN_DIALECTS (DEFINE_SCAN_KERNEL, avx512)
+#endif /* MAGA_CSV_X86 */
+
+#define SCAN_KERNEL_ENTRY(isa, name, delim, quote) scan_##isa##_##name,
+
+static const csv_scan_fn scan_scalar_kernels[] = {
+  SCAN_DIALECTS (SCAN_KERNEL_ENTRY, scalar)
+};
+
+#ifdef MAGA_CSV_X86
+static const csv_scan_fn scan_sse42_kernels[] = {
+  SCAN_DIALECTS (SCAN_KERNEL_ENTRY, sse42)
+};
+
+static const csv_scan_fn scan_avx2_kernels[] = {
+  SCAN_DIALECTS (SCAN_KERNEL_ENTRY, avx2)
+};
+
+static const csv_scan_fn scan_avx512_kernels[] = {
+  SCAN_DIALECTS (SCAN_KERNEL_ENTRY, avx512)
+};
+#endif
+
+/*
+ * pick the widest kernel the cpu supports.  MAGA_CSV_ISA=scalar, sse4.2,
+ * avx2 or avx512 selects a specific kernel if the cpu supports it.
+ */
 static void
-field_collect (void *str, size_t str_len, void *data)
+scanner_select (void)
 {
-  //fprintf (stderr, "collect: \"%s\"\n", (char *) str);
-  struct row_cb_data *rcbd = (struct row_cb_data *) data;
-  if (rcbd->row.capacity == 0)
+  const char *wanted = getenv ("MAGA_CSV_ISA");
+  struct
+  {
+    const char *name;
+    const csv_scan_fn *scan;
+    bool supported;
+  } kernels[] = {
+#ifdef MAGA_CSV_X86
+    {"avx512", scan_avx512_kernels, __builtin_cpu_supports ("avx512bw")
+     && __builtin_cpu_supports ("pclmul")},
+    {"avx2", scan_avx2_kernels, __builtin_cpu_supports ("avx2")
+     && __builtin_cpu_supports ("pclmul")},
+    {"sse4.2", scan_sse42_kernels, __builtin_cpu_supports ("sse4.2")
+     && __builtin_cpu_supports ("pclmul")},
+#endif
+    {"scalar", scan_scalar_kernels, true},
+  };
+  const size_t count = sizeof (kernels) / sizeof (kernels[0]);
+
+  csv_scan_kernels = NULL;
+  for (size_t i = 0; i < count && wanted != NULL; i++)
     {
-      rcbd->row = row_new (ROW_INITIAL_CAPACITY);
+      if (kernels[i].supported && strcmp (kernels[i].name, wanted) == 0)
+	{
+	  csv_scan_kernels = kernels[i].scan;
+	  csv_scan_isa = kernels[i].name;
+	}
     }
-  if (rcbd->row.length > 0)
+  for (size_t i = 0; i < count && csv_scan_kernels == NULL; i++)
     {
-      row_append (&rcbd->row, &RT_START, 1);
+      if (kernels[i].supported)
+	{
+	  csv_scan_kernels = kernels[i].scan;
+	  csv_scan_isa = kernels[i].name;
+	}
     }
-  row_append (&rcbd->row, str, str_len);
 }
 
-static void
-row_collect (int c, void *data)
+/* the kernel of the selected instruction set for dialect */
+static csv_scan_fn
+scanner_for (const struct csv_dialect *dialect)
 {
-  //fprintf (stderr, "row collect\n");
-  struct row_cb_data *rcbd = (struct row_cb_data *) data;
-  row_queue_push_back (rcbd->rq, &rcbd->row);
-  //fprintf (stderr, "row collect end: %d, %s\n", c, rcbd->row.text);
-  for (int i = 0; i < rcbd->row.length; i++)
+  if (dialect->escape != dialect->quote)
+    {
+      return scan_escaped;
+    }
+  for (size_t i = 0; i < sizeof (scan_delims); i++)
     {
-      //fprintf (stderr, "%d ", rcbd->row.text[i]);
+      if (dialect->delim == scan_delims[i] && dialect->quote == CSV_QUOTE)
+	{
+	  return csv_scan_kernels[i];
+	}
     }
-  //fprintf (stderr, "\n");
-  rcbd->row = row_new (ROW_INITIAL_CAPACITY);
+  return csv_scan_kernels[sizeof (scan_delims)];
 }
 
-static int
-emit_record (struct csv_state *state, char **out, row_t row, char **rt_start,
-	     size_t * rt_len)
+static struct row_queue *
+row_queue_new ()
 {
-  *rt_start = &RT_START;
-  *rt_len = RT_LEN;
+  struct row_queue *rq = gawk_malloc (sizeof (struct row_queue));
+  rq->begin = 0;
+  rq->count = 0;
+  rq->capacity = ROW_QUEUE_INITIAL_CAPACITY;
+  rq->high_water = 0;
+  rq->bytes = 0;
+  rq->rows = gawk_malloc (rq->capacity * sizeof (row_t));
+  return rq;
+}
 
-  *out = row.text;
-  state->out_to_free = *out;
-  return row.length;
+static row_t
+row_queue_pop_front (struct row_queue *rq)
+{
+  assert (rq->count > 0);
+  row_t row = rq->rows[rq->begin];
+  rq->begin = (rq->begin + 1) & (rq->capacity - 1);
+  rq->count--;
+  rq->bytes -= row.length;
+  return row;
 }
 
-static int
-csv_get_record (char **out, struct awk_input *iobuf, int *errcode,
-		char **rt_start, size_t * rt_len)
+/* double the ring, unwrapping the queued rows to the front */
+static void
+row_queue_grow (struct row_queue *rq)
 {
-  //fprintf (stderr, "get_record\n");
-  struct csv_state *state = (struct csv_state *) iobuf->opaque;
+  const size_t capacity = rq->capacity * 2;
+  row_t *rows = gawk_malloc (capacity * sizeof (row_t));
+  const size_t head = MIN (rq->count, rq->capacity - rq->begin);
+  memcpy (rows, rq->rows + rq->begin, head * sizeof (row_t));
+  memcpy (rows + head, rq->rows, (rq->count - head) * sizeof (row_t));
+  gawk_free (rq->rows);
+  rq->rows = rows;
+  rq->capacity = capacity;
+  rq->begin = 0;
+}
 
-  /* free row of previous run */
-  if (state->out_to_free != NULL)
+static void
+row_queue_push_back (struct row_queue *rq, row_t * row)
+{
+  if (rq->count == rq->capacity)
     {
-      //fprintf (stderr, "freeing row: %p\n", state->out_to_free);
-      gawk_free (state->out_to_free);
+      row_queue_grow (rq);
     }
-
-  // maybe keep one buffer in opaque struct...
-  if (!row_queue_empty (state->row_queue))
+  rq->rows[(rq->begin + rq->count) & (rq->capacity - 1)] = *row;
+  rq->count++;
+  rq->bytes += row->length;
+  if (rq->count > rq->high_water)
     {
-      //fprintf (stderr, "rq not empty\n");
-      row_t row = row_queue_pop_front (state->row_queue);
-      //fprintf (stderr, "rq popped\n");
-      // when do we free row!? maye gawk does it... ?
-      return emit_record (state, out, row, rt_start, rt_len);
+      rq->high_water = rq->count;
     }
+}
+
+static row_t
+row_queue_pop_back (struct row_queue *rq)
+{
+  assert (rq->count > 0);
+  rq->count--;
+  const row_t row = rq->rows[(rq->begin + rq->count) & (rq->capacity - 1)];
+  rq->bytes -= row.length;
+  return row;
+}
+
+static bool
+row_queue_empty (struct row_queue *rq)
+{
+  return rq->count == 0;
+}
 
-  size_t buflen = 0;
-  //fprintf (stderr, "before loop\n");
-  while ((buflen = read (iobuf->fd, state->read_buffer, READ_SZ)) > 0)
+static void
+row_queue_clear (struct row_queue *rq)
+{
+  rq->begin = 0;
+  rq->count = 0;
+  rq->bytes = 0;
+}
+
+static void
+row_queue_destroy (struct row_queue *rq)
+{
+  gawk_free (rq->rows);
+  gawk_free (rq);
+}
+
+static char *
+row_arena_alloc (struct row_arena *arena, size_t size)
+{
+  struct row_slab *slab = arena->current;
+  if (slab == NULL || slab->size - slab->used < size)
     {
-      //fprintf (stderr, "parse\n");
-      csv_parse (state->parser, state->read_buffer, buflen, field_collect,
-		 row_collect, &state->rcbd);
-      //fprintf (stderr, "after parse\n");
-      // if have data, emit; return.
-      if (!row_queue_empty (state->row_queue))
+      slab = (slab != NULL) ? slab->next : arena->first;
+      if (slab == NULL || slab->size < size)
 	{
-	  //fprintf (stderr, "in loop, popping and emitting record.\n");
-	  row_t row = row_queue_pop_front (state->row_queue);
-	  return emit_record (state, out, row, rt_start, rt_len);
+	  struct row_slab *fresh;
+	  const size_t fresh_size = MAX (size, ROW_SLAB_SZ);
+	  fresh = gawk_malloc (sizeof (struct row_slab) + fresh_size);
+	  fresh->size = fresh_size;
+	  fresh->used = 0;
+	  fresh->next = slab;
+	  arena->slabs++;
+	  if (arena->current == NULL)
+	    {
+	      arena->first = fresh;
+	    }
+	  else
+	    {
+	      arena->current->next = fresh;
+	    }
+	  slab = fresh;
 	}
+      arena->current = slab;
     }
-
-  return EOF;
+  char *text = slab->text + slab->used;
+  slab->used += size;
+  return text;
 }
 
-static awk_bool_t
-csv_can_take_file (const awk_input_buf_t * iobuf)
+/* give back the unused end of the last allocation */
+static void
+row_arena_shrink (struct row_arena *arena, char *text, size_t used)
 {
-  //fprintf (stderr, "csv_can_take_file()\n");
-
-  if (iobuf == NULL)
-    return awk_false;
+  arena->current->used = (text - arena->current->text) + used;
+}
 
-  return (iobuf->fd != INVALID_HANDLE);
+#ifdef MAGA_CSV_WIDTHS
+/* room for the widths of at most fields fields and their count */
+static uint32_t *
+row_arena_widths (struct row_arena *arena, size_t fields)
+{
+  char *room = row_arena_alloc (arena, (fields + 1) * sizeof (uint32_t) + 3);
+  return (uint32_t *) (room + (-(uintptr_t) room & 3));
 }
+#endif
 
 static void
-csv_close (awk_input_buf_t * iobuf)
+row_arena_reset (struct row_arena *arena)
 {
-  struct csv_state *state = (struct csv_state *) iobuf->opaque;
-  gawk_free (state->read_buffer);
-  csv_free (state->parser);
-  row_queue_destroy (state->row_queue);
-  gawk_free (state);
+  for (struct row_slab * slab = arena->first; slab != NULL;
+       slab = slab->next)
+    {
+      slab->used = 0;
+    }
+  arena->current = arena->first;
 }
 
-static awk_bool_t
-csv_take_control_of (awk_input_buf_t * iobuf)
+static void
+row_arena_destroy (struct row_arena *arena)
 {
-  // we would set the FS to 31 here, but gawk doesn't allow it. qq
-  //fprintf (stderr, "opening %s...\n", iobuf->name);
-  //fprintf (stderr, "RT %d...\n", RT_START);
-  if (iobuf->fd == INVALID_HANDLE)
+  struct row_slab *slab = arena->first;
+  while (slab != NULL)
     {
-      return 1;
+      struct row_slab *next = slab->next;
+      gawk_free (slab);
+      slab = next;
     }
-
-  struct csv_state *state = gawk_malloc (sizeof (struct csv_state));
-  // setup parser
-  state->parser = gawk_malloc (sizeof (struct csv_parser));
-  memset (state->parser, 0, sizeof (struct csv_parser));
-  csv_init (state->parser, CSV_APPEND_NULL);
-  // setup buffer
-  state->read_buffer = gawk_malloc (READ_SZ);
-  // setup row_queue
-  state->row_queue = row_queue_new ();
-  // setup callback structure
-  struct row_cb_data rcbd = { {0} };
-  rcbd.rq = state->row_queue;
-  state->rcbd = rcbd;
-  state->out_to_free = NULL;
-
-  //fprintf (stderr, "after read...\n");
-  iobuf->opaque = state;
-  iobuf->get_record = csv_get_record;
-  iobuf->close_func = csv_close;
-  //fprintf (stderr, "returning...\n");
-  fflush (stderr);
-  return awk_true;
+  arena->first = NULL;
+  arena->current = NULL;
 }
 
-static awk_input_parser_t csv_parser = {
-  .name = "csv",
-  .can_take_file = csv_can_take_file,
-  .take_control_of = csv_take_control_of,
+/*
+ * copy the field buf[from, to) to out, whose quotes and escapes are at
+ * index[first, last).  quotes and escapes are dropped and "" inside a
+ * quoted field becomes ".  returns the end of the copy, which is never
+ * longer than the field.
+ */
+static char *
+field_copy (const struct csv_dialect *dialect, char *out, const char *buf,
+	    size_t from, size_t to, const uint32_t * index, size_t first,
+	    size_t last)
+{
+  const bool doubled = dialect->escape == dialect->quote;
+  bool quoted = false;
+
+  for (size_t k = first; k < last; k++)
+    {
+      const size_t at = index[k];
+      memcpy (out, buf + from, at - from);
+      out += at - from;
+      if (!doubled && buf[at] == dialect->escape)
+	{
+	  /* the byte after the escape is copied as text */
+	}
+      else if (doubled && quoted && k + 1 < last && index[k + 1] == at + 1
+	       && buf[at + 1] == dialect->quote)
+	{
+	  /* keep the second quote of "" as text */
+	  k++;
+	}
+      else
+	{
+	  quoted = !quoted;
+	}
+      from = at + 1;
+    }
+  memcpy (out, buf + from, to - from);
+  return out + (to - from);
+}
+
+/*
+ * convert the record buf[start, end) to the gawk format in one pass over
+ * its structural offsets: delimiters become RT_START and the fields
+ * between them are unescaped.  the output is never longer than the
+ * input, so that much is taken from the arena up front.
+ */
+static void
+row_build (const struct csv_dialect *dialect, struct row_arena *arena,
+	   struct row_queue *rq, struct csv_stats *stats, const char *buf,
+	   size_t start, size_t end, const uint32_t * index, size_t count)
+{
+#ifdef MAGA_CSV_WIDTHS
+  /* before the text, which is shrunk once its length is known */
+  uint32_t *widths = row_arena_widths (arena, count + 1);
+#endif
+  row_t row = {
+    .length = 0,
+    .text = row_arena_alloc (arena, end - start)
+  };
+  char *out = row.text;
+  size_t from = start;
+  size_t first = 0;
+  size_t fields = 1;
+  size_t quoted = count > 0 && buf[index[0]] != dialect->delim;
+
+  for (size_t k = 0; k < count; k++)
+    {
+      if (buf[index[k]] == dialect->delim)
+	{
+#ifdef MAGA_CSV_WIDTHS
+	  char *field = out;
+#endif
+	  out = field_copy (dialect, out, buf, from, index[k], index, first,
+			    k);
+#ifdef MAGA_CSV_WIDTHS
+	  widths[fields] = out - field;
+#endif
+	  *out++ = RT_START;
+	  from = index[k] + 1;
+	  first = k + 1;
+	  fields++;
+	  quoted += first < count && buf[index[first]] != dialect->delim;
+	}
+    }
+#ifdef MAGA_CSV_WIDTHS
+  char *field = out;
+#endif
+  out = field_copy (dialect, out, buf, from, end, index, first, count);
+  stats->fields += fields;
+  stats->quoted += quoted;
+#ifdef MAGA_CSV_WIDTHS
+  widths[fields] = out - field;
+  widths[0] = fields;
+  row.widths = widths;
+#endif
+
+  row.length = out - row.text;
+  row_arena_shrink (arena, row.text, row.length);
+  row_queue_push_back (rq, &row);
+}
+
+/*
+ * find the spans of the first needed fields of the record buf[start,
+ * end).  returns how many it has, at most needed.
+ */
+static size_t
+field_spans (const struct csv_dialect *dialect, struct field_span *spans,
+	     size_t needed, const char *buf, size_t start, size_t end,
+	     const uint32_t * index, size_t count)
+{
+  size_t fields = 0;
+  size_t from = start;
+  size_t first = 0;
+
+  for (size_t k = 0; k < count && fields < needed; k++)
+    {
+      if (buf[index[k]] == dialect->delim)
+	{
+	  spans[fields++] = (struct field_span) {from, index[k], first, k};
+	  from = index[k] + 1;
+	  first = k + 1;
+	}
+    }
+  if (fields < needed)
+    {
+      spans[fields++] = (struct field_span) {from, end, first, count};
+    }
+  return fields;
+}
+
+/*
+ * like row_build, but only the projected fields are copied, in the order
+ * of the projection.  spans holds the fields of the record up to the
+ * last projected one, fields the record lacks are empty.
+ */
+static void
+row_project (const struct csv_dialect *dialect,
+	     const struct csv_projection *projection,
+	     const struct field_span *spans, size_t fields,
+	     struct row_arena *arena, struct row_queue *rq,
+	     struct csv_stats *stats, const char *buf, const uint32_t * index)
+{
+  size_t size = projection->count;
+  for (size_t i = 0; i < projection->count; i++)
+    {
+      const size_t column = projection->columns[i];
+      if (column < fields)
+	{
+	  size += spans[column].to - spans[column].from;
+	}
+    }
+
+#ifdef MAGA_CSV_WIDTHS
+  uint32_t *widths = row_arena_widths (arena, projection->count);
+  widths[0] = projection->count;
+#endif
+  row_t row = {
+    .length = 0,
+    .text = row_arena_alloc (arena, size)
+  };
+  char *out = row.text;
+  for (size_t i = 0; i < projection->count; i++)
+    {
+      const size_t column = projection->columns[i];
+      if (i > 0)
+	{
+	  *out++ = RT_START;
+	}
+#ifdef MAGA_CSV_WIDTHS
+      char *field = out;
+#endif
+      if (column < fields)
+	{
+	  const struct field_span *span = &spans[column];
+	  out = field_copy (dialect, out, buf, span->from, span->to, index,
+			    span->first, span->last);
+	  stats->quoted += span->first < span->last;
+	}
+#ifdef MAGA_CSV_WIDTHS
+      widths[i + 1] = out - field;
+#endif
+    }
+  stats->fields += projection->count;
+#ifdef MAGA_CSV_WIDTHS
+  row.widths = widths;
+#endif
+
+  row.length = out - row.text;
+  row_arena_shrink (arena, row.text, row.length);
+  row_queue_push_back (rq, &row);
+}
+
+/*
+ * the unescaped, NUL terminated value of a field.  fields without quotes
+ * or escapes are compared in place unless terminate is set, others are
+ * copied to the scratch buffer of state.
+ */
+static const char *
+field_value (struct csv_state *state, const char *buf,
+	     const uint32_t * index, const struct field_span *span,
+	     bool terminate, size_t *length)
+{
+  if (span->first == span->last && !terminate)
+    {
+      *length = span->to - span->from;
+      return buf + span->from;
+    }
+  const size_t size = span->to - span->from + 1;
+  if (state->scratch_size < size)
+    {
+      state->scratch_size = MAX (size, 2 * state->scratch_size);
+      state->scratch = gawk_realloc (state->scratch, state->scratch_size);
+    }
+  char *end = field_copy (&state->dialect, state->scratch, buf, span->from,
+			  span->to, index, span->first, span->last);
+  *end = '\0';
+  *length = end - state->scratch;
+  return state->scratch;
+}
+
+static const double csv_powers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * the number text[0, length) starts with, as awk converts strings:
+ * leading blanks are skipped and text without a decimal number is 0.
+ * up to 15 digits times a power of ten up to 1e22 are exact doubles,
+ * so one multiplication or division rounds like strtod; longer numbers
+ * are handed to strtod.
+ */
+static double
+csv_number (const char *text, size_t length)
+{
+  const char *end = text + length;
+  const char *p = text;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+    {
+      p++;
+    }
+  const char *start = p;
+  const bool negative = p < end && *p == '-';
+  if (p < end && (*p == '+' || *p == '-'))
+    {
+      p++;
+    }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool number = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      number = true;
+      if (digits < 19)
+	{
+	  mantissa = mantissa * 10 + (*p - '0');
+	  digits += mantissa != 0;
+	}
+      else
+	{
+	  exponent++;
+	}
+    }
+  if (p < end && *p == '.')
+    {
+      for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+	  number = true;
+	  if (digits < 19)
+	    {
+	      mantissa = mantissa * 10 + (*p - '0');
+	      digits += mantissa != 0;
+	      exponent--;
+	    }
+	}
+    }
+  if (!number)
+    {
+      return 0;
+    }
+  if (p + 1 < end && (*p == 'e' || *p == 'E'))
+    {
+      const char *q = p + 1 + (p[1] == '+' || p[1] == '-');
+      if (q < end && *q >= '0' && *q <= '9')
+	{
+	  int power = 0;
+	  for (; q < end && *q >= '0' && *q <= '9'; q++)
+	    {
+	      power = MIN (power * 10 + (*q - '0'), 100000);
+	    }
+	  exponent += p[1] == '-' ? -power : power;
+	  p = q;
+	}
+    }
+
+  if (digits <= 15 && exponent >= -22 && exponent <= 22)
+    {
+      const double value = exponent < 0
+	? mantissa / csv_powers[-exponent] : mantissa * csv_powers[exponent];
+      return negative ? -value : value;
+    }
+  char copy[64];
+  const size_t size = p - start;
+  char *decimal = size < sizeof (copy) ? copy : gawk_malloc (size + 1);
+  memcpy (decimal, start, size);
+  decimal[size] = '\0';
+  const double value = strtod (decimal, NULL);
+  if (decimal != copy)
+    {
+      gawk_free (decimal);
+    }
+  return value;
+}
+
+static bool
+csv_predicate_match (const struct csv_predicate *predicate,
+		     const char *text, size_t length)
+{
+  switch (predicate->op)
+    {
+    case PREDICATE_RANGE:
+      {
+	const double number = csv_number (text, length);
+	return number >= predicate->low && number <= predicate->high;
+      }
+    case PREDICATE_PREFIX:
+      return length >= predicate->values[0].length
+	&& memcmp (text, predicate->values[0].text,
+		   predicate->values[0].length) == 0;
+    case PREDICATE_EQUAL:
+    case PREDICATE_IN:
+      for (size_t i = 0; i < predicate->count; i++)
+	{
+	  if (length == predicate->values[i].length
+	      && memcmp (text, predicate->values[i].text, length) == 0)
+	    {
+	      return true;
+	    }
+	}
+      return false;
+    }
+  return false;
+}
+
+/* whether the record whose fields are spans passes the filter of state */
+static bool
+csv_filter_match (struct csv_state *state, const char *buf,
+		  const uint32_t * index, const struct field_span *spans,
+		  size_t fields)
+{
+  const struct csv_filter *filter = &state->filter;
+  for (size_t i = 0; i < filter->count; i++)
+    {
+      const struct csv_predicate *predicate = &filter->predicates[i];
+      const char *text = "";
+      size_t length = 0;
+      if (predicate->column < fields)
+	{
+	  text = field_value (state, buf, index, &spans[predicate->column],
+			      predicate->op == PREDICATE_RANGE, &length);
+	}
+      if (!csv_predicate_match (predicate, text, length))
+	{
+	  return false;
+	}
+    }
+  return true;
+}
+
+static void
+csv_predicate_destroy (struct csv_predicate *predicate)
+{
+  for (size_t i = 0; i < predicate->count; i++)
+    {
+      gawk_free (predicate->values[i].text);
+    }
+  gawk_free (predicate->values);
+  gawk_free (predicate->name);
+}
+
+static void
+csv_filter_destroy (struct csv_filter *filter)
+{
+  for (size_t i = 0; i < filter->count; i++)
+    {
+      csv_predicate_destroy (&filter->predicates[i]);
+    }
+  gawk_free (filter->predicates);
+}
+
+static uint64_t
+group_hash (const char *key, size_t length)
+{
+  uint64_t hash = 0x9e3779b97f4a7c15 ^ length;
+  for (size_t i = 0; i < length; i += 8)
+    {
+      uint64_t word = 0;
+      memcpy (&word, key + i, MIN (8, length - i));
+      hash = (hash ^ word) * 0xff51afd7ed558ccd;
+      hash ^= hash >> 32;
+    }
+  hash *= 0xc4ceb9fe1a85ec53;
+  return hash ^ (hash >> 29);
+}
+
+static void
+group_table_init (struct group_table *table)
+{
+  table->capacity = 64;
+  table->slots = gawk_calloc (table->capacity, sizeof (struct group_slot));
+  table->size = table->capacity / 2;
+  table->count = 0;
+  table->entries = gawk_malloc (table->size * sizeof (struct group_entry));
+  table->keys.first = NULL;
+  table->keys.current = NULL;
+  table->keys.slabs = 0;
+}
+
+static void
+group_table_destroy (struct group_table *table)
+{
+  gawk_free (table->slots);
+  gawk_free (table->entries);
+  row_arena_destroy (&table->keys);
+}
+
+/* drop every group, but keep the room for them */
+static void
+group_table_clear (struct group_table *table)
+{
+  memset (table->slots, 0, table->capacity * sizeof (struct group_slot));
+  table->count = 0;
+  row_arena_reset (&table->keys);
+}
+
+static void
+group_table_place (struct group_table *table, uint64_t hash, size_t entry)
+{
+  size_t slot = hash & (table->capacity - 1);
+  while (table->slots[slot].entry != 0)
+    {
+      slot = (slot + 1) & (table->capacity - 1);
+    }
+  table->slots[slot].check = hash >> 32;
+  table->slots[slot].entry = entry + 1;
+}
+
+/* double the slots and the room for groups */
+static void
+group_table_grow (struct group_table *table)
+{
+  gawk_free (table->slots);
+  table->capacity *= 2;
+  table->slots = gawk_calloc (table->capacity, sizeof (struct group_slot));
+  for (size_t i = 0; i < table->count; i++)
+    {
+      group_table_place (table, table->entries[i].hash, i);
+    }
+  table->size = table->capacity / 2;
+  table->entries = gawk_realloc (table->entries,
+				 table->size * sizeof (struct group_entry));
+}
+
+/* the group of key, added with empty totals if it is new */
+static struct group_entry *
+group_table_find (struct group_table *table, const char *key,
+		  size_t length, uint64_t hash)
+{
+  const uint32_t check = hash >> 32;
+  size_t slot = hash & (table->capacity - 1);
+  for (;;)
+    {
+      const struct group_slot *found = &table->slots[slot];
+      if (found->entry == 0)
+	{
+	  break;
+	}
+      struct group_entry *entry = &table->entries[found->entry - 1];
+      if (found->check == check && entry->length == length
+	  && memcmp (entry->key, key, length) == 0)
+	{
+	  return entry;
+	}
+      slot = (slot + 1) & (table->capacity - 1);
+    }
+
+  if (table->count == table->size)
+    {
+      group_table_grow (table);
+      return group_table_find (table, key, length, hash);
+    }
+  table->slots[slot].check = check;
+  table->slots[slot].entry = table->count + 1;
+  struct group_entry *entry = &table->entries[table->count++];
+  char *copy = row_arena_alloc (&table->keys, MAX (length, 1));
+  memcpy (copy, key, length);
+  entry->hash = hash;
+  entry->key = copy;
+  entry->length = length;
+  entry->count = 0;
+  entry->sum = 0;
+  entry->min = HUGE_VAL;
+  entry->max = -HUGE_VAL;
+  return entry;
+}
+
+/*
+ * add the totals of every group of from to those in table.  into an
+ * empty table the groups are moved instead, which leaves from empty.
+ */
+static void
+group_table_merge (struct group_table *table, struct group_table *from)
+{
+  if (table->count == 0)
+    {
+      const struct group_table empty = *table;
+      *table = *from;
+      *from = empty;
+      return;
+    }
+  for (size_t i = 0; i < from->count; i++)
+    {
+      const struct group_entry *entry = &from->entries[i];
+      struct group_entry *total =
+	group_table_find (table, entry->key, entry->length, entry->hash);
+      total->count += entry->count;
+      total->sum += entry->sum;
+      total->min = MIN (total->min, entry->min);
+      total->max = MAX (total->max, entry->max);
+    }
+}
+
+/*
+ * add the record whose fields are spans to the group of its key in
+ * every aggregation of state.  the fields of a key are joined with
+ * SUBSEP, as gawk does for a[$1, $2].
+ */
+static void
+csv_groups_add (struct csv_state *state, const char *buf,
+		const uint32_t * index, const struct field_span *spans,
+		size_t fields)
+{
+  struct csv_groups *groups = &state->groups;
+  for (size_t i = 0; i < groups->count; i++)
+    {
+      struct csv_group *group = &groups->groups[i];
+      size_t length = 0;
+      for (size_t k = 0; k < group->keys.count; k++)
+	{
+	  const size_t column = group->keys.columns[k];
+	  const char *text = "";
+	  size_t size = 0;
+	  if (column < fields)
+	    {
+	      text = field_value (state, buf, index, &spans[column], false,
+				  &size);
+	    }
+	  if (groups->key_size < length + groups->subsep_length + size)
+	    {
+	      groups->key_size = MAX (2 * groups->key_size,
+				      length + groups->subsep_length + size);
+	      groups->key = gawk_realloc (groups->key, groups->key_size);
+	    }
+	  if (k > 0)
+	    {
+	      memcpy (groups->key + length, groups->subsep,
+		      groups->subsep_length);
+	      length += groups->subsep_length;
+	    }
+	  memcpy (groups->key + length, text, size);
+	  length += size;
+	}
+
+      struct group_entry *entry =
+	group_table_find (&group->table, groups->key, length,
+			  group_hash (groups->key, length));
+      entry->count++;
+      if (group->column != SIZE_MAX)
+	{
+	  double value = 0;
+	  if (group->column < fields)
+	    {
+	      size_t size;
+	      const char *text = field_value (state, buf, index,
+					      &spans[group->column], false,
+					      &size);
+	      value = csv_number (text, size);
+	    }
+	  entry->sum += value;
+	  entry->min = MIN (entry->min, value);
+	  entry->max = MAX (entry->max, value);
+	}
+    }
+}
+
+/* aggregations registered with csv_group_by(), applied to each input */
+static struct csv_aggregation *csv_aggregations;
+static size_t csv_aggregation_count;
+static size_t csv_aggregation_generation;
+
+static const char *const csv_group_ops[] = {
+  "count", "sum", "min", "max", "mean"
+};
+
+#define GROUP_OPS (sizeof (csv_group_ops) / sizeof (char *))
+
+/* empty groups for a worker, sharing the columns of groups */
+static void
+csv_groups_clone (struct csv_groups *clone, const struct csv_groups *groups)
+{
+  *clone = *groups;
+  clone->groups =
+    gawk_malloc (MAX (groups->count, 1) * sizeof (struct csv_group));
+  memcpy (clone->groups, groups->groups,
+	  groups->count * sizeof (struct csv_group));
+  for (size_t i = 0; i < clone->count; i++)
+    {
+      group_table_init (&clone->groups[i].table);
+    }
+  clone->key = gawk_malloc (clone->key_size);
+}
+
+/*
+ * free the groups of a worker.  its rows were aggregated in the tables
+ * of their batches, which gawk's thread merged as it took them.
+ */
+static void
+csv_groups_clone_destroy (struct csv_groups *clone)
+{
+  for (size_t i = 0; i < clone->count; i++)
+    {
+      group_table_destroy (&clone->groups[i].table);
+    }
+  gawk_free (clone->groups);
+  gawk_free (clone->key);
+}
+
+/*
+ * exchange the tables of groups with those of batch.  a worker of a
+ * segment aggregates each batch in tables of their own this way, so the
+ * rows of a batch that is dropped are never added up.
+ */
+static void
+csv_groups_swap (struct csv_groups *groups, struct csv_batch *batch)
+{
+  if (batch->groups == NULL && groups->count > 0)
+    {
+      batch->groups = gawk_malloc (groups->count
+				   * sizeof (struct group_table));
+      batch->group_count = groups->count;
+      for (size_t i = 0; i < batch->group_count; i++)
+	{
+	  group_table_init (&batch->groups[i]);
+	}
+    }
+  for (size_t i = 0; i < batch->group_count; i++)
+    {
+      const struct group_table table = groups->groups[i].table;
+      groups->groups[i].table = batch->groups[i];
+      batch->groups[i] = table;
+    }
+}
+
+/* add the groups of a batch gawk takes to those of the input */
+static void
+csv_groups_take (struct csv_groups *groups, struct csv_batch *batch)
+{
+  for (size_t i = 0; i < batch->group_count; i++)
+    {
+      group_table_merge (&groups->groups[i].table, &batch->groups[i]);
+    }
+}
+
+/*
+ * add the groups of a closed input to the results of its aggregations,
+ * unless csv_group_by() has dropped them meanwhile, and free them.
+ */
+static void
+csv_groups_destroy (struct csv_groups *groups)
+{
+  for (size_t i = 0; i < groups->count; i++)
+    {
+      struct csv_group *group = &groups->groups[i];
+      if (groups->generation == csv_aggregation_generation)
+	{
+	  group_table_merge (&csv_aggregations[group->id].table,
+			     &group->table);
+	}
+      group_table_destroy (&group->table);
+      gawk_free (group->keys.columns);
+    }
+  gawk_free (groups->groups);
+  gawk_free (groups->subsep);
+  gawk_free (groups->key);
+}
+
+/*
+ * a record without quotes is handed to gawk straight from the input
+ * buffer, only its delimiters are rewritten to RT_START in place.
+ */
+static void
+row_borrow (struct row_arena *arena, struct row_queue *rq, char *buf,
+	    size_t start, size_t end, const uint32_t * index, size_t count)
+{
+#ifdef MAGA_CSV_WIDTHS
+  uint32_t *widths = row_arena_widths (arena, count + 1);
+  size_t from = start;
+  widths[0] = count + 1;
+#else
+  (void) arena;
+#endif
+  for (size_t k = 0; k < count; k++)
+    {
+      buf[index[k]] = RT_START;
+#ifdef MAGA_CSV_WIDTHS
+      widths[k + 1] = index[k] - from;
+      from = index[k] + 1;
+#endif
+    }
+  row_t row = {
+    .length = end - start,
+    .text = buf + start
+  };
+#ifdef MAGA_CSV_WIDTHS
+  widths[count + 1] = end - from;
+  row.widths = widths;
+#endif
+  row_queue_push_back (rq, &row);
+}
+
+static uint64_t
+csv_sample_random (struct csv_sample *sample)
+{
+  uint64_t x = sample->random;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  sample->random = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+static struct csv_sample *
+csv_sample_new (size_t size, uint64_t seed)
+{
+  struct csv_sample *sample = gawk_malloc (sizeof (struct csv_sample));
+  sample->size = size;
+  sample->seen = 0;
+  sample->random = seed | 1;
+  sample->rows = gawk_calloc (size, sizeof (struct sample_row));
+  sample->flushed = false;
+  return sample;
+}
+
+/* keep a copy of row if it is drawn into the sample */
+static void
+csv_sample_offer (struct csv_sample *sample, row_t row)
+{
+  size_t slot = sample->seen;
+  if (slot >= sample->size)
+    {
+      slot = csv_sample_random (sample) % (sample->seen + 1);
+    }
+  if (slot < sample->size)
+    {
+      struct sample_row *kept = &sample->rows[slot];
+      kept->ordinal = sample->seen;
+      kept->row.text = gawk_realloc (kept->row.text, MAX (row.length, 1));
+      kept->row.length = row.length;
+      memcpy (kept->row.text, row.text, row.length);
+#ifdef MAGA_CSV_WIDTHS
+      const size_t size = (row.widths[0] + 1) * sizeof (uint32_t);
+      kept->row.widths = gawk_realloc (kept->row.widths, size);
+      memcpy (kept->row.widths, row.widths, size);
+#endif
+    }
+  sample->seen++;
+}
+
+static int
+sample_row_compare (const void *a, const void *b)
+{
+  const struct sample_row *x = a;
+  const struct sample_row *y = b;
+  return (x->ordinal > y->ordinal) - (x->ordinal < y->ordinal);
+}
+
+/* queue the sampled rows in input order, they stay owned by sample */
+static void
+csv_sample_flush (struct csv_sample *sample, struct row_queue *rq)
+{
+  const size_t kept = MIN (sample->seen, sample->size);
+  qsort (sample->rows, kept, sizeof (struct sample_row), sample_row_compare);
+  for (size_t i = 0; i < kept; i++)
+    {
+      row_queue_push_back (rq, &sample->rows[i].row);
+    }
+  sample->flushed = true;
+}
+
+static void
+csv_sample_destroy (struct csv_sample *sample)
+{
+  for (size_t i = 0; i < sample->size; i++)
+    {
+      gawk_free (sample->rows[i].row.text);
+#ifdef MAGA_CSV_WIDTHS
+      gawk_free (sample->rows[i].row.widths);
+#endif
+    }
+  gawk_free (sample->rows);
+  gawk_free (sample);
+}
+
+/* note where the record starting at text is, every SIDECAR_INTERVAL */
+static void
+csv_sidecar_add (struct csv_state *state, const char *text)
+{
+  struct csv_sidecar *sidecar = state->sidecar;
+  if (sidecar->count == sidecar->capacity)
+    {
+      sidecar->capacity = MAX (64, 2 * sidecar->capacity);
+      sidecar->offsets = gawk_realloc (sidecar->offsets,
+				       sidecar->capacity * sizeof (uint64_t));
+    }
+  sidecar->offsets[sidecar->count++] = text - state->buffer;
+  state->mark += SIDECAR_INTERVAL;
+}
+
+/*
+ * the length of the valid UTF-8 prefix of text.  if it is not all of
+ * text, bad is the length of the invalid sequence after it: a lead byte
+ * and as many continuation bytes as could still belong to it.  runs of
+ * ASCII are skipped 16 bytes at a time.
+ */
+static size_t
+utf8_check (const char *text, size_t length, size_t *bad)
+{
+  const unsigned char *bytes = (const unsigned char *) text;
+  size_t i = 0;
+  for (;;)
+    {
+#ifdef __SSE2__
+      for (; i + 16 <= length; i += 16)
+	{
+	  const __m128i v = _mm_loadu_si128 ((const __m128i *) (bytes + i));
+	  if (_mm_movemask_epi8 (v) != 0)
+	    {
+	      break;
+	    }
+	}
+#endif
+      while (i < length && bytes[i] < 0x80)
+	{
+	  i++;
+	}
+      if (i == length)
+	{
+	  return length;
+	}
+
+      const unsigned char lead = bytes[i];
+      size_t size = 0;
+      unsigned char low = 0x80;
+      unsigned char high = 0xbf;
+      if (lead >= 0xc2 && lead <= 0xdf)
+	{
+	  size = 2;
+	}
+      else if (lead >= 0xe0 && lead <= 0xef)
+	{
+	  size = 3;
+	  low = lead == 0xe0 ? 0xa0 : 0x80;	/* overlong */
+	  high = lead == 0xed ? 0x9f : 0xbf;	/* surrogates */
+	}
+      else if (lead >= 0xf0 && lead <= 0xf4)
+	{
+	  size = 4;
+	  low = lead == 0xf0 ? 0x90 : 0x80;	/* overlong */
+	  high = lead == 0xf4 ? 0x8f : 0xbf;	/* above U+10FFFF */
+	}
+      *bad = 1;
+      if (size == 0 || i + 1 == length || bytes[i + 1] < low
+	  || bytes[i + 1] > high)
+	{
+	  return i;
+	}
+      for (size_t k = 2; k < size; k++)
+	{
+	  if (i + k == length || (bytes[i + k] & 0xc0) != 0x80)
+	    {
+	      *bad = k;
+	      return i;
+	    }
+	}
+      i += size;
+    }
+}
+
+/*
+ * copy text to out with U+FFFD in place of every invalid sequence and
+ * count them.  returns the end of the copy, at most 3 * length on.
+ */
+static char *
+utf8_replace (char *out, const char *text, size_t length, size_t *invalid)
+{
+  while (length > 0)
+    {
+      size_t bad = 0;
+      const size_t valid = utf8_check (text, length, &bad);
+      memcpy (out, text, valid);
+      out += valid;
+      if (valid == length)
+	{
+	  break;
+	}
+      memcpy (out, "\xef\xbf\xbd", 3);
+      out += 3;
+      text += valid + bad;
+      length -= valid + bad;
+      (*invalid)++;
+    }
+  return out;
+}
+
+/*
+ * apply CSV_UTF8 to the row queued last.  a replaced row is copied to
+ * the arena, so it is built afterwards.  returns false if the row was
+ * dropped because it ends the input.
+ */
+static bool
+csv_utf8_row (struct csv_state *state, bool *built)
+{
+  struct row_queue *rq = state->batch->row_queue;
+  row_t row = row_queue_pop_back (rq);
+  size_t bad = 0;
+  const size_t valid = utf8_check (row.text, row.length, &bad);
+  if (valid == row.length)
+    {
+      row_queue_push_back (rq, &row);
+      return true;
+    }
+
+  if (state->utf8 == UTF8_REJECT)
+    {
+      state->stats.invalid++;
+      state->batch->error = EILSEQ;
+      state->batch->eof = true;
+      state->limit = 0;
+      return false;
+    }
+  if (state->utf8 == UTF8_PASS)
+    {
+      for (size_t at = valid; at < row.length;)
+	{
+	  at += bad;
+	  state->stats.invalid++;
+	  at += utf8_check (row.text + at, row.length - at, &bad);
+	}
+      row_queue_push_back (rq, &row);
+      return true;
+    }
+
+  struct row_arena *arena = &state->batch->arena;
+  char *text = row_arena_alloc (arena, 3 * row.length);
+#ifdef MAGA_CSV_WIDTHS
+  /* fields are replaced one by one to know their new widths */
+  char *out = text;
+  const char *from = row.text;
+  for (size_t i = 1; i <= row.widths[0]; i++)
+    {
+      if (i > 1)
+	{
+	  *out++ = *from++;
+	}
+      char *field = out;
+      out = utf8_replace (out, from, row.widths[i], &state->stats.invalid);
+      from += row.widths[i];
+      row.widths[i] = out - field;
+    }
+#else
+  char *out = utf8_replace (text, row.text, row.length,
+			    &state->stats.invalid);
+#endif
+  row.text = text;
+  row.length = out - text;
+  row_arena_shrink (arena, text, row.length);
+  row_queue_push_back (rq, &row);
+  *built = true;
+  return true;
+}
+
+/*
+ * turn a complete record into a row, unless CSV_SKIP, the filter or
+ * CSV_LIMIT drop it.  skipped records are never split into fields.
+ */
+static void
+row_queue_record (struct csv_state *state, char *buf, size_t start,
+		  size_t end, const uint32_t * index, size_t count,
+		  bool quoted)
+{
+  struct row_queue *rq = state->batch->row_queue;
+  state->stats.records++;
+  if (state->record++ == state->mark)
+    {
+      csv_sidecar_add (state, buf + start);
+    }
+  if (state->skip > 0)
+    {
+      state->skip--;
+      return;
+    }
+
+  size_t fields = 0;
+  if (state->needed > 0)
+    {
+      fields = field_spans (&state->dialect, state->spans, state->needed, buf,
+			    start, end, index, count);
+    }
+  if (state->filter.count > 0
+      && !csv_filter_match (state, buf, index, state->spans, fields))
+    {
+      return;
+    }
+  if (state->rows_left != SIZE_MAX && --state->rows_left == 0)
+    {
+      /* stop at the next record, so the rest is never read */
+      state->limit = 0;
+    }
+  if (state->groups.count > 0)
+    {
+      csv_groups_add (state, buf, index, state->spans, fields);
+    }
+  if (state->discard)
+    {
+      return;
+    }
+
+  bool built = true;
+  if (state->projection.count > 0)
+    {
+      row_project (&state->dialect, &state->projection, state->spans, fields,
+		   &state->batch->arena, rq, &state->stats, buf, index);
+    }
+  else if (quoted || !state->borrow)
+    {
+      row_build (&state->dialect, &state->batch->arena, rq, &state->stats,
+		 buf, start, end, index, count);
+    }
+  else
+    {
+      row_borrow (&state->batch->arena, rq, buf, start, end, index, count);
+      state->stats.fields += count + 1;
+      built = false;
+    }
+  if (state->utf8 != UTF8_OFF && !csv_utf8_row (state, &built))
+    {
+      return;
+    }
+
+  if (state->sample != NULL)
+    {
+      const row_t row = row_queue_pop_back (rq);
+      csv_sample_offer (state->sample, row);
+      if (built)
+	{
+	  row_arena_shrink (&state->batch->arena, row.text, 0);
+	}
+    }
+}
+
+/* whether the batch holds as many rows or bytes as it may */
+static bool
+csv_queue_full (const struct csv_state *state)
+{
+  const struct row_queue *rq = state->batch->row_queue;
+  return rq->count >= state->queue_rows || rq->bytes >= state->queue_bytes;
+}
+
+/*
+ * scan the next window of buffered input and queue its complete records
+ * until the batch is full; the rest of the window is parsed by the next
+ * call.  line breaks end records, empty records are skipped.  the last
+ * record of the input does not need a line break.  returns false if
+ * more input must be read before the next record can be found.
+ */
+static bool
+csv_parse_window (struct csv_state *state)
+{
+  const struct csv_dialect *dialect = &state->dialect;
+  size_t start = state->offset;
+  size_t len, count;
+  size_t first = 0;
+  if (state->paused == state->offset)
+    {
+      /* go on with the window left when the queue was full */
+      start = state->window_start;
+      len = state->window_length;
+      count = state->window_count;
+      first = state->window_next;
+    }
+  else
+    {
+      len = MIN (state->length - start, state->window);
+      count = dialect->scan (dialect, state->buffer + start, len,
+			     state->index);
+    }
+  state->paused = SIZE_MAX;
+  char *buf = state->buffer + start;
+  const size_t avail = state->length - start;
+  const uint32_t *index = state->index;
+  size_t consumed = state->offset - start;
+  bool quoted = false;
+
+  for (size_t k = first; k < count; k++)
+    {
+      const char c = buf[index[k]];
+      if (c == dialect->quote || c == dialect->escape)
+	{
+	  quoted = true;
+	}
+      if (c != '\n' && c != '\r')
+	{
+	  continue;
+	}
+      if (start + consumed >= state->limit)
+	{
+	  break;
+	}
+      if (index[k] > consumed)
+	{
+	  row_queue_record (state, buf, consumed, index[k], index + first,
+			    k - first, quoted);
+	}
+      consumed = index[k] + 1;
+      first = k + 1;
+      quoted = false;
+      if (csv_queue_full (state))
+	{
+	  /* the rest of the window waits for the next batch */
+	  state->offset = start + consumed;
+	  state->paused = state->offset;
+	  state->window_start = start;
+	  state->window_length = len;
+	  state->window_count = count;
+	  state->window_next = first;
+	  return true;
+	}
+    }
+
+  if (len == avail && state->eof && consumed < len
+      && start + consumed < state->limit)
+    {
+      row_queue_record (state, buf, consumed, len, index + first,
+			count - first, quoted);
+      consumed = len;
+    }
+
+  state->offset = start + consumed;
+  if (consumed > 0)
+    {
+      return true;
+    }
+  if (len < avail)
+    {
+      /* a single record is larger than the window */
+      state->window *= 2;
+      state->index = gawk_realloc (state->index,
+				   state->window * sizeof (uint32_t));
+      state->stats.grows++;
+      return true;
+    }
+  return false;
+}
+
+#ifdef MAGA_CSV_URING
+
+/*
+ * io_uring reader for regular files that are not mapped.  reads of the
+ * next URING_DEPTH blocks of the file are kept in flight, so the disk
+ * works while the current block is parsed.  csv_uring_read copies the
+ * oldest block into the parse buffer and then queues the next one in
+ * its slot.
+ */
+struct csv_uring
+{
+  int ring_fd;
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_sz;
+  void *cq_ring;
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+  char *buffers[URING_DEPTH];
+  off_t offsets[URING_DEPTH];
+  int results[URING_DEPTH];
+  bool pending[URING_DEPTH];
+  unsigned current;		/* slot copied from next */
+  size_t taken;			/* bytes of it copied already */
+  off_t next_offset;		/* file offset of the next read queued */
+};
+
+static int
+uring_enter (int ring_fd, unsigned to_submit, unsigned min_complete,
+	     unsigned flags)
+{
+  int ret;
+  do
+    {
+      ret = syscall (__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		     flags, NULL, 0);
+    }
+  while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+static void
+uring_queue (struct csv_uring *u, unsigned slot)
+{
+  const unsigned tail = *u->sq_tail;
+  const unsigned at = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[at];
+
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = u->fd;
+  sqe->off = u->next_offset;
+  sqe->addr = (uintptr_t) u->buffers[slot];
+  sqe->len = URING_BUF_SZ;
+  sqe->user_data = slot;
+  u->sq_array[at] = at;
+  __atomic_store_n (u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  u->offsets[slot] = u->next_offset;
+  u->next_offset += URING_BUF_SZ;
+  u->pending[slot] = true;
+  if (uring_enter (u->ring_fd, 1, 0, 0) < 0)
+    {
+      u->results[slot] = -errno;
+      u->pending[slot] = false;
+    }
+}
+
+/* wait for at least one completion and record its result */
+static void
+uring_reap (struct csv_uring *u)
+{
+  unsigned head = *u->cq_head;
+  while (head == __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      uring_enter (u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    }
+  while (head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+      u->results[cqe->user_data] = cqe->res;
+      u->pending[cqe->user_data] = false;
+      head++;
+    }
+  __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+uring_drain (struct csv_uring *u)
+{
+  for (unsigned slot = 0; slot < URING_DEPTH; slot++)
+    {
+      while (u->pending[slot])
+	{
+	  uring_reap (u);
+	}
+    }
+}
+
+static void
+csv_uring_destroy (struct csv_uring *u)
+{
+  /* the kernel may still write into the buffers until reads complete */
+  uring_drain (u);
+  munmap (u->sqes, u->sqes_sz);
+  if (u->cq_ring != u->sq_ring)
+    {
+      munmap (u->cq_ring, u->cq_ring_sz);
+    }
+  munmap (u->sq_ring, u->sq_ring_sz);
+  close (u->ring_fd);
+  for (unsigned slot = 0; slot < URING_DEPTH; slot++)
+    {
+      gawk_free (u->buffers[slot]);
+    }
+  gawk_free (u);
+}
+
+/*
+ * set up a ring for fd and queue the first reads.  returns NULL where
+ * io_uring is missing, forbidden or too old for IORING_OP_READ.
+ */
+static struct csv_uring *
+csv_uring_new (int fd)
+{
+  const off_t start = lseek (fd, 0, SEEK_CUR);
+  if (start < 0)
+    {
+      return NULL;
+    }
+
+  struct io_uring_params params;
+  memset (&params, 0, sizeof (params));
+  const int ring_fd = syscall (__NR_io_uring_setup, URING_DEPTH, &params);
+  if (ring_fd < 0)
+    {
+      return NULL;
+    }
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+      /* IORING_OP_READ came with the same kernel */
+      close (ring_fd);
+      return NULL;
+    }
+
+  struct csv_uring *u = gawk_calloc (1, sizeof (struct csv_uring));
+  u->ring_fd = ring_fd;
+  u->fd = fd;
+  u->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  u->cq_ring_sz = params.cq_off.cqes
+    + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      u->sq_ring_sz = u->cq_ring_sz = MAX (u->sq_ring_sz, u->cq_ring_sz);
+    }
+  u->sqes_sz = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  u->sq_ring = mmap (NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  u->cq_ring = u->sq_ring;
+  if (u->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      u->cq_ring = mmap (NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring_fd,
+			 IORING_OFF_CQ_RING);
+    }
+  u->sqes = mmap (NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED
+      || u->sqes == MAP_FAILED)
+    {
+      if (u->sqes != MAP_FAILED)
+	{
+	  munmap (u->sqes, u->sqes_sz);
+	}
+      if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+	{
+	  munmap (u->cq_ring, u->cq_ring_sz);
+	}
+      if (u->sq_ring != MAP_FAILED)
+	{
+	  munmap (u->sq_ring, u->sq_ring_sz);
+	}
+      close (ring_fd);
+      gawk_free (u);
+      return NULL;
+    }
+
+  char *sq = u->sq_ring;
+  char *cq = u->cq_ring;
+  u->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  u->sq_array = (unsigned *) (sq + params.sq_off.array);
+  u->cq_head = (unsigned *) (cq + params.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  u->next_offset = start;
+  for (unsigned slot = 0; slot < URING_DEPTH; slot++)
+    {
+      u->buffers[slot] = gawk_malloc (URING_BUF_SZ);
+      uring_queue (u, slot);
+    }
+  return u;
+}
+
+/*
+ * copy up to room bytes of the oldest block to dest, like read().  a
+ * short block means the end of the file or an interrupted read, so the
+ * reads queued behind it are dropped and queued again right after it.
+ */
+static ssize_t
+csv_uring_read (struct csv_uring *u, char *dest, size_t room)
+{
+  const unsigned slot = u->current;
+  while (u->pending[slot])
+    {
+      uring_reap (u);
+    }
+
+  const int res = u->results[slot];
+  if (res < 0)
+    {
+      errno = -res;
+      return -1;
+    }
+  if (res == 0)
+    {
+      return 0;
+    }
+
+  const size_t n = MIN (room, (size_t) res - u->taken);
+  memcpy (dest, u->buffers[slot] + u->taken, n);
+  u->taken += n;
+  if (u->taken == (size_t) res)
+    {
+      u->taken = 0;
+      if (res < URING_BUF_SZ)
+	{
+	  uring_drain (u);
+	  u->next_offset = u->offsets[slot] + res;
+	  for (unsigned i = 1; i <= URING_DEPTH; i++)
+	    {
+	      uring_queue (u, (slot + i) % URING_DEPTH);
+	    }
+	}
+      else
+	{
+	  uring_queue (u, slot);
+	}
+      u->current = (slot + 1) % URING_DEPTH;
+    }
+  return n;
+}
+
+#endif /* MAGA_CSV_URING */
+
+enum csv_codec
+{
+  CODEC_NONE,
+  CODEC_GZIP,
+  CODEC_ZSTD,
+};
+
+static const unsigned char gzip_magic[2] = { 0x1f, 0x8b };
+static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+/*
+ * compressed input is decompressed on a helper thread into a ring of
+ * INFLATE_BLOCKS blocks, so it overlaps with parsing.  an empty block
+ * ends the input, a block with an error ends it with that errno.
+ */
+struct csv_inflate
+{
+  int fd;
+  enum csv_codec codec;
+  pthread_t thread;
+  bool threaded;		/* false if blocks are filled on demand */
+  char *input;			/* compressed bytes read from fd */
+  size_t prefix;		/* bytes of input already read at start */
+  z_stream gzip;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  ZSTD_inBuffer zstd_input;
+#endif
+  bool finished;		/* the last frame or member is complete */
+  bool trailer;			/* what follows it is not gzip, ignored */
+  char *blocks[INFLATE_BLOCKS];
+  size_t lengths[INFLATE_BLOCKS];
+  int errors[INFLATE_BLOCKS];
+  sem_t filled;
+  sem_t free;
+  unsigned consume;		/* slot copied from next */
+  size_t taken;			/* bytes of it copied already */
+  bool holding;			/* consume has been waited for */
+};
+
+static ssize_t
+read_retry (int fd, void *dest, size_t size)
+{
+  ssize_t n;
+  do
+    {
+      n = read (fd, dest, size);
+    }
+  while (n < 0 && errno == EINTR);
+  return n;
+}
+
+/* decompress gzip members, one after another, into out */
+static int
+inflate_fill_gzip (struct csv_inflate *z, char *out, size_t size,
+		   size_t *length)
+{
+  z_stream *zs = &z->gzip;
+  zs->next_out = (Bytef *) out;
+  zs->avail_out = size;
+  while (zs->avail_out > 0 && !z->trailer)
+    {
+      if (zs->avail_in == 0)
+	{
+	  const ssize_t n = read_retry (z->fd, z->input, INFLATE_INPUT_SZ);
+	  if (n < 0)
+	    {
+	      return errno;
+	    }
+	  if (n == 0)
+	    {
+	      break;
+	    }
+	  zs->next_in = (Bytef *) z->input;
+	  zs->avail_in = n;
+	}
+      if (z->finished && zs->total_in == 0
+	  && (zs->next_in[0] != gzip_magic[0]
+	      || (zs->avail_in > 1 && zs->next_in[1] != gzip_magic[1])))
+	{
+	  /* like gzip -d, ignore bytes after a member that start no other */
+	  z->trailer = true;
+	  break;
+	}
+      const int ret = inflate (zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+	{
+	  inflateReset (zs);
+	  z->finished = true;
+	}
+      else if (ret == Z_OK || (ret == Z_BUF_ERROR && zs->avail_in == 0))
+	{
+	  z->finished = z->finished && zs->total_in == 0;
+	}
+      else
+	{
+	  return EIO;
+	}
+    }
+  *length = size - zs->avail_out;
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+/* decompress zstd frames, one after another, into out */
+static int
+inflate_fill_zstd (struct csv_inflate *z, char *out, size_t size,
+		   size_t *length)
+{
+  ZSTD_outBuffer output = { out, size, 0 };
+  while (output.pos < output.size)
+    {
+      if (z->zstd_input.pos == z->zstd_input.size)
+	{
+	  const ssize_t n = read_retry (z->fd, z->input, INFLATE_INPUT_SZ);
+	  if (n < 0)
+	    {
+	      return errno;
+	    }
+	  if (n == 0)
+	    {
+	      break;
+	    }
+	  z->zstd_input.src = z->input;
+	  z->zstd_input.size = n;
+	  z->zstd_input.pos = 0;
+	}
+      const size_t ret =
+	ZSTD_decompressStream (z->zstd, &output, &z->zstd_input);
+      if (ZSTD_isError (ret))
+	{
+	  return EIO;
+	}
+      z->finished = ret == 0;
+    }
+  *length = output.pos;
+  return 0;
+}
+#endif
+
+/* decompress the next block into slot, true if more may follow */
+static bool
+inflate_fill (struct csv_inflate *z, unsigned slot)
+{
+  size_t length = 0;
+  int error;
+#ifdef HAVE_ZSTD
+  if (z->codec == CODEC_ZSTD)
+    {
+      error = inflate_fill_zstd (z, z->blocks[slot], INFLATE_BLOCK_SZ,
+				 &length);
+    }
+  else
+#endif
+    {
+      error = inflate_fill_gzip (z, z->blocks[slot], INFLATE_BLOCK_SZ,
+				 &length);
+    }
+  if (error == 0 && length == 0 && !z->finished)
+    {
+      /* the input ends inside a frame */
+      error = EIO;
+    }
+  z->lengths[slot] = length;
+  z->errors[slot] = error;
+  return error == 0 && length > 0;
+}
+
+static void *
+csv_inflate_run (void *data)
+{
+  struct csv_inflate *z = (struct csv_inflate *) data;
+  bool more = true;
+  for (unsigned slot = 0; more; slot = (slot + 1) % INFLATE_BLOCKS)
+    {
+      while (sem_wait (&z->free) != 0)
+	{
+	}
+      more = inflate_fill (z, slot);
+      sem_post (&z->filled);
+    }
+  return NULL;
+}
+
+/* whether the got bytes of magic may still begin a compressed input */
+static bool
+csv_magic_prefix (const unsigned char *magic, size_t got)
+{
+  return (got < sizeof (gzip_magic) && memcmp (magic, gzip_magic, got) == 0)
+    || (got < sizeof (zstd_magic) && memcmp (magic, zstd_magic, got) == 0);
+}
+
+/*
+ * the codec of the input by its magic bytes.  a regular file is peeked at
+ * with pread(), from anything else the bytes are read and *consumed is
+ * set to how many of them are in magic.  a pipe is only read again while
+ * what arrived may still be magic, so a slow writer of plain text does
+ * not hold up the first record.
+ */
+static enum csv_codec
+csv_detect_codec (int fd, const struct stat *sbuf, unsigned char *magic,
+		  size_t *consumed)
+{
+  ssize_t got = 0;
+  *consumed = 0;
+  if (S_ISREG (sbuf->st_mode))
+    {
+      const off_t offset = lseek (fd, 0, SEEK_CUR);
+      got = offset < 0 ? -1 : pread (fd, magic, 4, offset);
+    }
+  else
+    {
+      while (csv_magic_prefix (magic, got))
+	{
+	  const ssize_t n = read_retry (fd, magic + got, 4 - got);
+	  if (n <= 0)
+	    {
+	      break;
+	    }
+	  got += n;
+	}
+      *consumed = got;
+    }
+  if (got >= 2 && memcmp (magic, gzip_magic, sizeof (gzip_magic)) == 0)
+    {
+      return CODEC_GZIP;
+    }
+  if (got >= 4 && memcmp (magic, zstd_magic, sizeof (zstd_magic)) == 0)
+    {
+      return CODEC_ZSTD;
+    }
+  return CODEC_NONE;
+}
+
+/*
+ * start decompressing fd, whose first prefix bytes were read into magic
+ * already.  returns NULL if codec is not supported by this build.
+ */
+static struct csv_inflate *
+csv_inflate_new (int fd, enum csv_codec codec, const unsigned char *magic,
+		 size_t prefix)
+{
+#ifndef HAVE_ZSTD
+  if (codec == CODEC_ZSTD)
+    {
+      warning (ext_id, "maga-csv: built without zstd, reading input as is");
+      return NULL;
+    }
+#endif
+  struct csv_inflate *z = gawk_calloc (1, sizeof (struct csv_inflate));
+  z->fd = fd;
+  z->codec = codec;
+  z->input = gawk_malloc (INFLATE_INPUT_SZ);
+  memcpy (z->input, magic, prefix);
+  if (codec == CODEC_GZIP)
+    {
+      z->gzip.next_in = (Bytef *) z->input;
+      z->gzip.avail_in = prefix;
+      /* 15 + 32 accepts gzip and zlib headers */
+      inflateInit2 (&z->gzip, 15 + 32);
+    }
+#ifdef HAVE_ZSTD
+  else
+    {
+      z->zstd = ZSTD_createDStream ();
+      ZSTD_initDStream (z->zstd);
+      z->zstd_input.src = z->input;
+      z->zstd_input.size = prefix;
+      z->zstd_input.pos = 0;
+    }
+#endif
+  z->finished = true;
+  for (unsigned slot = 0; slot < INFLATE_BLOCKS; slot++)
+    {
+      z->blocks[slot] = gawk_malloc (INFLATE_BLOCK_SZ);
+    }
+  sem_init (&z->filled, 0, 0);
+  sem_init (&z->free, 0, INFLATE_BLOCKS);
+  /* without a helper thread blocks are filled when they are needed */
+  z->threaded = pthread_create (&z->thread, NULL, csv_inflate_run, z) == 0;
+  return z;
+}
+
+static ssize_t
+csv_inflate_read (struct csv_inflate *z, char *dest, size_t room)
+{
+  const unsigned slot = z->consume % INFLATE_BLOCKS;
+  if (!z->holding && z->threaded)
+    {
+      while (sem_wait (&z->filled) != 0)
+	{
+	}
+    }
+  else if (!z->holding)
+    {
+      inflate_fill (z, slot);
+    }
+  z->holding = true;
+
+  if (z->errors[slot] != 0)
+    {
+      errno = z->errors[slot];
+      return -1;
+    }
+  const size_t n = MIN (room, z->lengths[slot] - z->taken);
+  memcpy (dest, z->blocks[slot] + z->taken, n);
+  z->taken += n;
+  if (n > 0 && z->taken == z->lengths[slot])
+    {
+      z->taken = 0;
+      z->holding = false;
+      z->consume++;
+      sem_post (&z->free);
+    }
+  return n;
+}
+
+static void
+csv_inflate_destroy (struct csv_inflate *z)
+{
+  if (z->threaded)
+    {
+      /* it may be blocked in read() or waiting for a free block */
+      pthread_cancel (z->thread);
+      pthread_join (z->thread, NULL);
+    }
+  if (z->codec == CODEC_GZIP)
+    {
+      inflateEnd (&z->gzip);
+    }
+#ifdef HAVE_ZSTD
+  else
+    {
+      ZSTD_freeDStream (z->zstd);
+    }
+#endif
+  sem_destroy (&z->filled);
+  sem_destroy (&z->free);
+  for (unsigned slot = 0; slot < INFLATE_BLOCKS; slot++)
+    {
+      gawk_free (z->blocks[slot]);
+    }
+  gawk_free (z->input);
+  gawk_free (z);
+}
+
+static uint64_t
+csv_clock (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* true if a read of fd would not block */
+static bool
+csv_readable (int fd)
+{
+  struct pollfd poller = {.fd = fd,.events = POLLIN };
+  return poll (&poller, 1, 0) > 0;
+}
+
+/*
+ * raise the capacity of a pipe so the writer is not stopped every 64 KB.
+ * unprivileged processes are held to /proc/sys/fs/pipe-max-size, so
+ * smaller sizes are tried as well.
+ */
+static void
+csv_pipe_grow (int fd)
+{
+#ifdef F_SETPIPE_SZ
+  for (int size = PIPE_SZ; size > 64 * 1024; size /= 2)
+    {
+      if (fcntl (fd, F_SETPIPE_SZ, size) >= 0)
+	{
+	  return;
+	}
+    }
+#else
+  (void) fd;
+#endif
+}
+
+static ssize_t
+csv_read (struct csv_state *state, char *dest, size_t room)
+{
+  if (state->inflate != NULL)
+    {
+      return csv_inflate_read (state->inflate, dest, room);
+    }
+#ifdef MAGA_CSV_URING
+  if (state->uring != NULL)
+    {
+      return csv_uring_read (state->uring, dest, room);
+    }
+#endif
+  return read (state->fd, dest, room);
+}
+
+/*
+ * move the unparsed tail of the buffer to its front and append the next
+ * read to it.  the buffer grows when one record does not fit.
+ */
+static int
+csv_fill (struct csv_state *state)
+{
+  if (state->offset > 0)
+    {
+      memmove (state->buffer, state->buffer + state->offset,
+	       state->length - state->offset);
+      state->length -= state->offset;
+      state->offset = 0;
+    }
+  if (state->length == state->capacity)
+    {
+      state->capacity *= 2;
+      state->buffer = gawk_realloc (state->buffer, state->capacity);
+      state->stats.grows++;
+    }
+
+  const uint64_t started = csv_clock ();
+  size_t total = 0;
+  ssize_t n;
+  for (;;)
+    {
+      n = csv_read (state, state->buffer + state->length + total,
+		    state->capacity - state->length - total);
+      state->stats.reads++;
+      if (n < 0 && errno == EINTR)
+	{
+	  continue;
+	}
+      if (n > 0)
+	{
+	  total += n;
+	}
+      /*
+       * a pipe returns what the writer has written so far, often a few
+       * KB.  take what else is already there, without waiting for more,
+       * so the scanner sees a full buffer instead of fragments.
+       */
+      if (n <= 0 || !state->stream
+	  || state->length + total == state->capacity
+	  || !csv_readable (state->fd))
+	{
+	  break;
+	}
+    }
+  state->stats.read_ns += csv_clock () - started;
+
+  if (n < 0 && total == 0)
+    {
+      return errno;
+    }
+  if (n == 0)
+    {
+      state->eof = true;
+    }
+  state->length += total;
+  state->stats.bytes += total;
+  return 0;
+}
+
+#ifdef MAGA_CSV_WIDTHS
+static int
+emit_record (struct csv_state *state, char **out, row_t row, char **rt_start,
+	     size_t * rt_len, const awk_fieldwidth_info_t ** field_width)
+#else
+static int
+emit_record (struct csv_state *state, char **out, row_t row, char **rt_start,
+	     size_t * rt_len)
+#endif
+{
+  *rt_start = &RT_START;
+  *rt_len = RT_LEN;
+
+#ifdef MAGA_CSV_WIDTHS
+  /* gawk reads the widths until it asks for the next record */
+  const size_t fields = row.widths[0];
+  if (state->widths_size < fields)
+    {
+      state->widths_size = MAX (fields, 2 * state->widths_size);
+      state->widths = gawk_realloc (state->widths,
+				    awk_fieldwidth_info_size
+				    (state->widths_size));
+    }
+  state->widths->use_chars = awk_false;
+  state->widths->nf = fields;
+  for (size_t i = 0; i < fields; i++)
+    {
+      state->widths->fields[i].skip = i > 0;
+      state->widths->fields[i].len = row.widths[i + 1];
+    }
+  *field_width = state->widths;
+#else
+  (void) state;
+#endif
+  *out = row.text;
+  return row.length;
+}
+
+static struct csv_batch *
+csv_batch_new (struct csv_batch *batch)
+{
+  batch->row_queue = row_queue_new ();
+  batch->arena.first = NULL;
+  batch->arena.current = NULL;
+  batch->arena.slabs = 0;
+  batch->error = 0;
+  batch->eof = false;
+  batch->segment = 0;
+  batch->parity = false;
+  batch->groups = NULL;
+  batch->group_count = 0;
+  return batch;
+}
+
+/* drop the rows of a batch and make it ready for new ones */
+static void
+csv_batch_reset (struct csv_batch *batch)
+{
+  row_queue_clear (batch->row_queue);
+  row_arena_reset (&batch->arena);
+  batch->error = 0;
+  batch->eof = false;
+  for (size_t i = 0; i < batch->group_count; i++)
+    {
+      group_table_clear (&batch->groups[i]);
+    }
+}
+
+static void
+csv_batch_destroy (struct csv_batch *batch)
+{
+  row_queue_destroy (batch->row_queue);
+  row_arena_destroy (&batch->arena);
+  for (size_t i = 0; i < batch->group_count; i++)
+    {
+      group_table_destroy (&batch->groups[i]);
+    }
+  gawk_free (batch->groups);
+}
+
+/*
+ * parse into state->batch until it holds at least min_rows rows or the
+ * input has ended.  the caller must have reset the batch.
+ */
+static void
+csv_parse_batch (struct csv_state *state, size_t min_rows)
+{
+  struct csv_batch *batch = state->batch;
+  const uint64_t started = csv_clock ();
+  const uint64_t read_ns = state->stats.read_ns;
+  size_t capacity = batch->row_queue->capacity;
+  const size_t slabs = batch->arena.slabs;
+
+  while (batch->row_queue->count < min_rows && !csv_queue_full (state)
+	 && !batch->eof)
+    {
+      if (state->offset >= state->limit)
+	{
+	  batch->eof = true;
+	  break;
+	}
+      if (state->offset < state->length && csv_parse_window (state))
+	{
+	  continue;
+	}
+      if (state->eof)
+	{
+	  batch->eof = true;
+	  break;
+	}
+      if (state->stream && !row_queue_empty (batch->row_queue)
+	  && !csv_readable (state->fd))
+	{
+	  /* hand on what a slow writer has sent instead of waiting */
+	  break;
+	}
+      batch->error = csv_fill (state);
+      if (batch->error != 0)
+	{
+	  batch->eof = true;
+	}
+    }
+  if (batch->eof && state->sample != NULL && !state->sample->flushed)
+    {
+      csv_sample_flush (state->sample, batch->row_queue);
+    }
+
+  struct csv_stats *stats = &state->stats;
+  stats->parse_ns += csv_clock () - started - (stats->read_ns - read_ns);
+  stats->grows += batch->arena.slabs - slabs;
+  for (; capacity < batch->row_queue->capacity; capacity *= 2)
+    {
+      stats->grows++;
+    }
+  stats->high_water = MAX (stats->high_water, batch->row_queue->high_water);
+}
+
+#ifdef MAGA_CSV_WIDTHS
+static int
+csv_get_record (char **out, struct awk_input *iobuf, int *errcode,
+		char **rt_start, size_t * rt_len,
+		const awk_fieldwidth_info_t ** field_width)
+#else
+static int
+csv_get_record (char **out, struct awk_input *iobuf, int *errcode,
+		char **rt_start, size_t * rt_len)
+#endif
+{
+  struct csv_state *state = (struct csv_state *) iobuf->opaque;
+  struct csv_batch *batch = state->batch;
+
+  if (row_queue_empty (batch->row_queue) && !batch->eof)
+    {
+      /* gawk has copied the previous record, its row can be reused */
+      row_arena_reset (&batch->arena);
+      csv_parse_batch (state, 1);
+    }
+  if (!row_queue_empty (batch->row_queue))
+    {
+      row_t row = row_queue_pop_front (batch->row_queue);
+#ifdef MAGA_CSV_WIDTHS
+      return emit_record (state, out, row, rt_start, rt_len, field_width);
+#else
+      return emit_record (state, out, row, rt_start, rt_len);
+#endif
+    }
+  if (batch->error != 0)
+    {
+      *errcode = batch->error;
+    }
+  return EOF;
+}
+
+static void
+csv_stats_add (struct csv_stats *sum, const struct csv_stats *stats)
+{
+  sum->bytes += stats->bytes;
+  sum->reads += stats->reads;
+  sum->records += stats->records;
+  sum->fields += stats->fields;
+  sum->quoted += stats->quoted;
+  sum->grows += stats->grows;
+  sum->high_water = MAX (sum->high_water, stats->high_water);
+  sum->read_ns += stats->read_ns;
+  sum->parse_ns += stats->parse_ns;
+  sum->invalid += stats->invalid;
+}
+
+/* what the counters now grew by since before */
+static void
+csv_stats_since (struct csv_stats *diff, const struct csv_stats *now,
+		 const struct csv_stats *before)
+{
+  diff->bytes = now->bytes - before->bytes;
+  diff->reads = now->reads - before->reads;
+  diff->records = now->records - before->records;
+  diff->fields = now->fields - before->fields;
+  diff->quoted = now->quoted - before->quoted;
+  diff->grows = now->grows - before->grows;
+  diff->high_water = now->high_water;
+  diff->read_ns = now->read_ns - before->read_ns;
+  diff->parse_ns = now->parse_ns - before->parse_ns;
+  diff->invalid = now->invalid - before->invalid;
+}
+
+static void
+batch_ring_init (struct batch_ring *ring)
+{
+  atomic_init (&ring->head, 0);
+  atomic_init (&ring->tail, 0);
+  sem_init (&ring->filled, 0, 0);
+}
+
+/* the ring has room for every batch, so pushing never waits */
+static void
+batch_ring_push (struct batch_ring *ring, struct csv_batch *batch)
+{
+  const size_t tail = atomic_load_explicit (&ring->tail,
+					    memory_order_relaxed);
+  ring->slots[tail % PIPELINE_BATCHES] = batch;
+  atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+  sem_post (&ring->filled);
+}
+
+static struct csv_batch *
+batch_ring_pop (struct batch_ring *ring)
+{
+  while (sem_wait (&ring->filled) != 0 && errno == EINTR)
+    {
+    }
+  const size_t head = atomic_load_explicit (&ring->head,
+					    memory_order_relaxed);
+  struct csv_batch *batch = ring->slots[head % PIPELINE_BATCHES];
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+  return batch;
+}
+
+/*
+ * the worker owns its parse state and every batch it has taken from the
+ * free ring.  gawk_malloc is plain malloc and safe to call here.
+ */
+static void *
+csv_pipeline_run (void *data)
+{
+  struct csv_worker *worker = (struct csv_worker *) data;
+  struct csv_state *state = worker->state;
+  bool eof = false;
+
+  while (!eof)
+    {
+      struct csv_batch *batch = batch_ring_pop (&worker->free);
+      const struct csv_stats before = state->stats;
+      csv_batch_reset (batch);
+      state->batch = batch;
+      csv_parse_batch (state, PIPELINE_BATCH_ROWS);
+      eof = batch->eof;
+      csv_stats_since (&batch->stats, &state->stats, &before);
+      batch_ring_push (&worker->ready, batch);
+    }
+  return NULL;
+}
+
+static bool
+count_quotes_odd (const char *buf, size_t len, const char quote)
+{
+  size_t quotes = 0;
+  for (size_t i = 0; i < len; i++)
+    {
+      quotes += buf[i] == quote;
+    }
+  return quotes & 1;
+}
+
+/*
+ * offset of the first record that starts at or after pos, for a buffer
+ * that is inside a quoted field at pos if quoted is set.  a record starts
+ * at pos itself if a line break outside of quotes precedes it.
+ */
+static size_t
+csv_record_start (const char *buf, size_t length, size_t pos, bool quoted,
+		  const char quote)
+{
+  if (pos == 0
+      || (!quoted && (buf[pos - 1] == '\n' || buf[pos - 1] == '\r')))
+    {
+      return pos;
+    }
+  for (size_t i = pos; i < length; i++)
+    {
+      const char c = buf[i];
+      if (c == quote)
+	{
+	  quoted = !quoted;
+	}
+      else if (!quoted && (c == '\n' || c == '\r'))
+	{
+	  return i + 1;
+	}
+    }
+  return length;
+}
+
+/* the first offset of a record noted in sidecar at or after pos */
+static size_t
+csv_sidecar_after (const struct csv_sidecar *sidecar, size_t pos,
+		   size_t length)
+{
+  size_t low = 0;
+  size_t high = sidecar->count;
+  while (low < high)
+    {
+      const size_t middle = low + (high - low) / 2;
+      if (sidecar->offsets[middle] < pos)
+	{
+	  low = middle + 1;
+	}
+      else
+	{
+	  high = middle;
+	}
+    }
+  return low < sidecar->count ? sidecar->offsets[low] : length;
+}
+
+/*
+ * point state at the records that start in the given segment.  with a
+ * sidecar the segment is moved to the noted records around it, which
+ * are known to start outside of quotes.
+ */
+static void
+csv_segment_prepare (struct csv_state *state, size_t segment, bool quoted)
+{
+  const size_t start = segment * SEGMENT_SZ;
+  const size_t end = MIN (start + SEGMENT_SZ, state->length);
+  if (state->sidecar != NULL)
+    {
+      state->offset = csv_sidecar_after (state->sidecar, start,
+					 state->length);
+      state->limit = end < state->length
+	? csv_sidecar_after (state->sidecar, end, state->length)
+	: state->length;
+    }
+  else
+    {
+      state->offset = csv_record_start (state->buffer, state->length, start,
+					quoted, state->dialect.quote);
+      state->limit = end;
+    }
+  state->offset = MAX (state->offset, state->begin);
+  state->paused = SIZE_MAX;
+}
+
+static bool
+csv_ordinary (const struct csv_dialect *dialect, char c)
+{
+  return c != dialect->delim && c != dialect->quote && c != '\n'
+    && c != '\r';
+}
+
+/*
+ * whether the next SHARD_PROBE_SZ bytes after pos are valid CSV if pos
+ * is inside a quoted field or not, as quoted says.  in valid CSV a
+ * quote only opens a field after a delimiter, a line break or another
+ * quote, and only closes one before such a byte.
+ */
+static bool
+csv_quote_state_valid (const struct csv_dialect *dialect, const char *buf,
+		       size_t length, size_t pos, bool quoted)
+{
+  const size_t end = MIN (length, pos + SHARD_PROBE_SZ);
+  for (size_t i = pos; i < end; i++)
+    {
+      if (buf[i] != dialect->quote)
+	{
+	  continue;
+	}
+      if (quoted && i + 1 < length && csv_ordinary (dialect, buf[i + 1]))
+	{
+	  return false;
+	}
+      if (!quoted && i > 0 && csv_ordinary (dialect, buf[i - 1]))
+	{
+	  return false;
+	}
+      quoted = !quoted;
+    }
+  return true;
+}
+
+/*
+ * guess whether pos is inside a quoted field from the bytes after it.
+ * the state at pos of valid CSV always passes csv_quote_state_valid, so
+ * if exactly one state does it is the right one.  returns 1 or 0, or -1
+ * if both or neither state pass, e.g. when there are no quotes nearby
+ * or the input is not valid CSV.
+ */
+static int
+csv_quote_guess (const struct csv_dialect *dialect, const char *buf,
+		 size_t length, size_t pos)
+{
+  const bool outside = csv_quote_state_valid (dialect, buf, length, pos,
+					      false);
+  const bool inside = csv_quote_state_valid (dialect, buf, length, pos,
+					     true);
+  return outside != inside ? inside : -1;
+}
+
+/*
+ * the first record of an escape dialect that starts at or after pos,
+ * found by walking the file from its start.
+ */
+static size_t
+csv_escaped_record_start (const struct csv_dialect *dialect,
+			  const char *buf, size_t length, size_t pos)
+{
+  bool quoted = false;
+  for (size_t i = 0; i < length; i++)
+    {
+      const char c = buf[i];
+      if (c == dialect->escape)
+	{
+	  i++;
+	}
+      else if (c == dialect->quote)
+	{
+	  quoted = !quoted;
+	}
+      else if (!quoted && (c == '\n' || c == '\r') && i + 1 >= pos)
+	{
+	  return i + 1;
+	}
+    }
+  return length;
+}
+
+/*
+ * the first record that starts at or after pos.  every process given a
+ * CSV_SHARD of the same file finds the same boundaries: from a sidecar,
+ * by walking an escape dialect from the start of the file, or from the
+ * quote state at pos.  that state is guessed from the bytes after pos
+ * and counted from the start of the file if the guess is unsure.
+ */
+static size_t
+csv_shard_boundary (const struct csv_state *state, size_t pos)
+{
+  const struct csv_dialect *dialect = &state->dialect;
+  if (pos == 0 || pos >= state->length)
+    {
+      return MIN (pos, state->length);
+    }
+  if (state->sidecar != NULL && state->sidecar->complete)
+    {
+      return csv_sidecar_after (state->sidecar, pos, state->length);
+    }
+  if (dialect->escape != dialect->quote)
+    {
+      return csv_escaped_record_start (dialect, state->buffer,
+				       state->length, pos);
+    }
+
+  const int guess = csv_quote_guess (dialect, state->buffer, state->length,
+				     pos);
+  const bool quoted = guess != -1 ? guess
+    : count_quotes_odd (state->buffer, pos, dialect->quote);
+  return csv_record_start (state->buffer, state->length, pos, quoted,
+			   dialect->quote);
+}
+
+/*
+ * parse the records of the i-th of count equal byte ranges of a mapped
+ * file: those that start in it, from the first whole one on.  the
+ * header is read in every shard.
+ */
+static void
+csv_shard (struct csv_state *state, size_t i, size_t count)
+{
+  const size_t start = state->length / count * (i - 1)
+    + MIN (state->length % count, i - 1);
+  const size_t end = state->length / count * i
+    + MIN (state->length % count, i);
+  state->offset = MAX (csv_shard_boundary (state, start), state->begin);
+  /* the last shard ends at the file's end, which marks it as a shard */
+  state->limit = csv_shard_boundary (state, end);
+  state->begin = state->offset;
+}
+
+static void *
+csv_segment_run (void *data)
+{
+  struct csv_worker *worker = (struct csv_worker *) data;
+  struct csv_pipeline *pipeline = worker->pipeline;
+  struct csv_state *state = worker->state;
+
+  for (size_t segment = worker->id; segment < pipeline->segments;
+       segment += pipeline->workers)
+    {
+      const size_t start = segment * SEGMENT_SZ;
+      const size_t end = MIN (start + SEGMENT_SZ, state->length);
+      const bool parity = state->sidecar == NULL
+	&& count_quotes_odd (state->buffer + start, end - start,
+			     state->dialect.quote);
+      csv_segment_prepare (state, segment, false);
+
+      bool done = false;
+      while (!done)
+	{
+	  struct csv_batch *batch = batch_ring_pop (&worker->free);
+	  const struct csv_stats before = state->stats;
+	  csv_batch_reset (batch);
+	  batch->segment = segment;
+	  batch->parity = parity;
+	  state->batch = batch;
+	  csv_groups_swap (&state->groups, batch);
+	  csv_parse_batch (state, PIPELINE_BATCH_ROWS);
+	  csv_groups_swap (&state->groups, batch);
+	  done = batch->eof;
+	  csv_stats_since (&batch->stats, &state->stats, &before);
+	  batch_ring_push (&worker->ready, batch);
+	}
+    }
+  return NULL;
+}
+
+#ifdef MAGA_CSV_WIDTHS
+static int
+csv_pipeline_get_record (char **out, struct awk_input *iobuf, int *errcode,
+			 char **rt_start, size_t * rt_len,
+			 const awk_fieldwidth_info_t ** field_width)
+#else
+static int
+csv_pipeline_get_record (char **out, struct awk_input *iobuf, int *errcode,
+			 char **rt_start, size_t * rt_len)
+#endif
+{
+  struct csv_state *state = (struct csv_state *) iobuf->opaque;
+  struct csv_pipeline *pipeline = state->pipeline;
+  struct csv_worker *worker = &pipeline->worker[0];
+
+  for (;;)
+    {
+      struct csv_batch *batch = pipeline->current;
+      if (batch != NULL && !row_queue_empty (batch->row_queue))
+	{
+	  row_t row = row_queue_pop_front (batch->row_queue);
+#ifdef MAGA_CSV_WIDTHS
+	  return emit_record (state, out, row, rt_start, rt_len,
+			      field_width);
+#else
+	  return emit_record (state, out, row, rt_start, rt_len);
+#endif
+	}
+      if (batch != NULL && batch->eof)
+	{
+	  if (batch->error != 0)
+	    {
+	      *errcode = batch->error;
+	    }
+	  return EOF;
+	}
+      /* gawk has copied every record of the batch, hand it back */
+      if (batch != NULL)
+	{
+	  batch_ring_push (&worker->free, batch);
+	}
+      pipeline->current = batch_ring_pop (&worker->ready);
+      csv_stats_add (&worker->seen, &pipeline->current->stats);
+    }
+}
+
+/*
+ * take the next batch of the current segment.  if the segment really
+ * starts inside a quoted field, the worker's batches of it are dropped
+ * and the segment is parsed again here.
+ */
+static struct csv_batch *
+csv_segment_next_batch (struct csv_state *state)
+{
+  struct csv_pipeline *pipeline = state->pipeline;
+  const size_t segment = pipeline->segment;
+  struct csv_worker *worker =
+    &pipeline->worker[segment % pipeline->workers];
+  struct csv_batch *batch = batch_ring_pop (&worker->ready);
+
+  if (!pipeline->segment_start || !pipeline->quoted)
+    {
+      pipeline->segment_start = false;
+      csv_stats_add (&worker->seen, &batch->stats);
+      csv_groups_take (&state->groups, batch);
+      return batch;
+    }
+
+  pipeline->segment_start = false;
+  while (!batch->eof)
+    {
+      batch_ring_push (&worker->free, batch);
+      batch = batch_ring_pop (&worker->ready);
+    }
+  struct csv_batch *fixup = &pipeline->fixup;
+  csv_batch_reset (fixup);
+  fixup->segment = segment;
+  fixup->parity = batch->parity;
+  batch_ring_push (&worker->free, batch);
+
+  csv_segment_prepare (state, segment, true);
+  state->batch = fixup;
+  csv_parse_batch (state, SIZE_MAX);
+  return fixup;
+}
+
+#ifdef MAGA_CSV_WIDTHS
+static int
+csv_segments_get_record (char **out, struct awk_input *iobuf, int *errcode,
+			 char **rt_start, size_t * rt_len,
+			 const awk_fieldwidth_info_t ** field_width)
+#else
+static int
+csv_segments_get_record (char **out, struct awk_input *iobuf, int *errcode,
+			 char **rt_start, size_t * rt_len)
+#endif
+{
+  struct csv_state *state = (struct csv_state *) iobuf->opaque;
+  struct csv_pipeline *pipeline = state->pipeline;
+
+  for (;;)
+    {
+      struct csv_batch *batch = pipeline->current;
+      if (batch != NULL && !row_queue_empty (batch->row_queue))
+	{
+	  row_t row = row_queue_pop_front (batch->row_queue);
+#ifdef MAGA_CSV_WIDTHS
+	  return emit_record (state, out, row, rt_start, rt_len,
+			      field_width);
+#else
+	  return emit_record (state, out, row, rt_start, rt_len);
+#endif
+	}
+      if (batch != NULL && batch->eof && batch->error != 0)
+	{
+	  /* CSV_UTF8=reject ended the segment and so the input */
+	  *errcode = batch->error;
+	  pipeline->segment = pipeline->segments;
+	  return EOF;
+	}
+      if (batch == &pipeline->fixup && !batch->eof)
+	{
+	  /* a segment parsed again is parsed a batch at a time as well */
+	  csv_batch_reset (batch);
+	  csv_parse_batch (state, SIZE_MAX);
+	  continue;
+	}
+      if (batch != NULL)
+	{
+	  if (batch->eof)
+	    {
+	      pipeline->quoted ^= batch->parity;
+	      pipeline->segment++;
+	      pipeline->segment_start = true;
+	    }
+	  if (batch != &pipeline->fixup)
+	    {
+	      const size_t owner = batch->segment % pipeline->workers;
+	      batch_ring_push (&pipeline->worker[owner].free, batch);
+	    }
+	  pipeline->current = NULL;
+	}
+      if (pipeline->segment == pipeline->segments)
+	{
+	  return EOF;
+	}
+      pipeline->current = csv_segment_next_batch (state);
+    }
+}
+
+/*
+ * the counters of an input as far as gawk's thread may read them.  a
+ * worker's own counters are only seen through the batches gawk took,
+ * so batches of a segment that is parsed again do not count; with
+ * segments, state also counts the file and the fixups.
+ */
+static void
+csv_input_stats (const struct csv_state *state, struct csv_stats *stats)
+{
+  const struct csv_pipeline *pipeline = state->pipeline;
+  if (pipeline == NULL)
+    {
+      *stats = state->stats;
+      return;
+    }
+  memset (stats, 0, sizeof (*stats));
+  if (pipeline->segments > 0)
+    {
+      *stats = state->stats;
+    }
+  for (size_t i = 0; i < pipeline->workers; i++)
+    {
+      csv_stats_add (stats, &pipeline->worker[i].seen);
+    }
+}
+
+static struct csv_state *
+csv_state_clone (const struct csv_state *state)
+{
+  struct csv_state *clone = gawk_malloc (sizeof (struct csv_state));
+  *clone = *state;
+  clone->index = gawk_malloc (clone->window * sizeof (uint32_t));
+  clone->paused = SIZE_MAX;
+  clone->spans = gawk_malloc (clone->needed * sizeof (struct field_span));
+  clone->scratch = NULL;
+  clone->scratch_size = 0;
+#ifdef MAGA_CSV_WIDTHS
+  clone->widths = NULL;
+  clone->widths_size = 0;
+#endif
+  csv_groups_clone (&clone->groups, &state->groups);
+  clone->batch = NULL;
+  memset (&clone->stats, 0, sizeof (clone->stats));
+  return clone;
+}
+
+static void
+csv_state_clone_destroy (struct csv_state *clone)
+{
+  gawk_free (clone->spans);
+  gawk_free (clone->scratch);
+  gawk_free (clone->index);
+  gawk_free (clone);
+}
+
+static void
+csv_pipeline_stop (struct csv_state *state)
+{
+  struct csv_pipeline *pipeline = state->pipeline;
+  for (size_t i = 0; i < pipeline->workers; i++)
+    {
+      /* the worker may be blocked in read() or waiting for a free batch */
+      struct csv_worker *worker = &pipeline->worker[i];
+      pthread_cancel (worker->thread);
+      pthread_join (worker->thread, NULL);
+      for (size_t j = 0; j < PIPELINE_BATCHES; j++)
+	{
+	  csv_batch_destroy (&worker->batches[j]);
+	}
+      sem_destroy (&worker->ready.filled);
+      sem_destroy (&worker->free.filled);
+      if (worker->state != state)
+	{
+	  csv_stats_add (&state->stats, &worker->seen);
+	  csv_groups_clone_destroy (&worker->state->groups);
+	  csv_state_clone_destroy (worker->state);
+	}
+    }
+  if (pipeline->segments > 0)
+    {
+      csv_batch_destroy (&pipeline->fixup);
+    }
+  gawk_free (pipeline->worker);
+  gawk_free (pipeline);
+  state->pipeline = NULL;
+}
+
+/*
+ * start the worker threads.  a single worker parses the input as a
+ * stream, several workers need a mapped file to cut into segments.  rows
+ * of a read() buffer are copied, since the worker refills the buffer
+ * while gawk still reads older batches, and rows of segments are copied
+ * because a segment may be parsed again.
+ */
+static bool
+csv_pipeline_start (struct csv_state *state, size_t threads)
+{
+  struct csv_pipeline *pipeline = gawk_malloc (sizeof (struct csv_pipeline));
+  /*
+   * segments rely on quote parity, which escapes break, unless a
+   * sidecar tells where records start.  they know nothing of the rows
+   * before them, which skip, limit and sample count and a sidecar that
+   * is being built numbers.  a CSV_SHARD is not cut any further.
+   */
+  const bool exact = state->sidecar != NULL && state->sidecar->complete;
+  const bool segmented = threads > 1 && state->mapped
+    && state->length > SEGMENT_SZ
+    && (state->dialect.escape == state->dialect.quote || exact)
+    && state->skip == 0 && state->rows_left == SIZE_MAX
+    && state->sample == NULL && (state->sidecar == NULL || exact)
+    && state->limit == SIZE_MAX;
+
+  pipeline->workers = segmented ? MIN (threads, PIPELINE_MAX_THREADS) : 1;
+  pipeline->worker =
+    gawk_malloc (pipeline->workers * sizeof (struct csv_worker));
+  pipeline->current = NULL;
+  pipeline->segments =
+    segmented ? (state->length + SEGMENT_SZ - 1) / SEGMENT_SZ : 0;
+  pipeline->segment = 0;
+  pipeline->segment_start = true;
+  pipeline->quoted = false;
+  if (segmented)
+    {
+      csv_batch_new (&pipeline->fixup);
+    }
+  state->pipeline = pipeline;
+  state->borrow = state->mapped && !segmented;
+
+  size_t started = 0;
+  for (; started < pipeline->workers; started++)
+    {
+      struct csv_worker *worker = &pipeline->worker[started];
+      worker->id = started;
+      worker->pipeline = pipeline;
+      worker->state = segmented ? csv_state_clone (state) : state;
+      memset (&worker->seen, 0, sizeof (worker->seen));
+      batch_ring_init (&worker->ready);
+      batch_ring_init (&worker->free);
+      for (size_t i = 0; i < PIPELINE_BATCHES; i++)
+	{
+	  batch_ring_push (&worker->free, csv_batch_new (&worker->batches[i]));
+	}
+      if (pthread_create (&worker->thread, NULL,
+			  segmented ? csv_segment_run : csv_pipeline_run,
+			  worker) != 0)
+	{
+	  break;
+	}
+    }
+  if (started < pipeline->workers)
+    {
+      struct csv_worker *failed = &pipeline->worker[started];
+      for (size_t i = 0; i < PIPELINE_BATCHES; i++)
+	{
+	  csv_batch_destroy (&failed->batches[i]);
+	}
+      if (failed->state != state)
+	{
+	  csv_groups_clone_destroy (&failed->state->groups);
+	  csv_state_clone_destroy (failed->state);
+	}
+      pipeline->workers = started;
+      csv_pipeline_stop (state);
+      state->borrow = true;
+      return false;
+    }
+  return true;
+}
+
+/*
+ * map a regular file so it is parsed without copying it through read().
+ * the whole file is then one buffer that is already at eof.  the mapping
+ * is private and writable so rows can be borrowed from it.
+ * MAGA_CSV_MMAP=0 disables this, e.g. for files that grow while read.
+ */
+static bool
+csv_map_file (struct csv_state *state, const struct stat *sbuf)
+{
+  const char *enabled = getenv ("MAGA_CSV_MMAP");
+  if (enabled != NULL && strcmp (enabled, "0") == 0)
+    {
+      return false;
+    }
+  if (!S_ISREG (sbuf->st_mode) || sbuf->st_size <= 0
+      || (uintmax_t) sbuf->st_size > SIZE_MAX)
+    {
+      return false;
+    }
+
+  const size_t size = sbuf->st_size;
+  void *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    state->fd, 0);
+  if (map == MAP_FAILED)
+    {
+      return false;
+    }
+  madvise (map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise (map, size, MADV_HUGEPAGE);
+#endif
+
+  state->buffer = map;
+  state->capacity = size;
+  state->length = size;
+  state->eof = true;
+  state->mapped = true;
+  state->stats.bytes = size;
+  return true;
+}
+
+/* the start of a .mcsvidx file, in native byte order; offsets follow */
+struct sidecar_header
+{
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t interval;
+  uint64_t records;
+  uint64_t count;
+  char delim;
+  char quote;
+  char escape;
+  char unused[5];
+};
+
+static const char sidecar_magic[8] = "MCSVIDX1";
+
+static void
+csv_sidecar_header (const struct csv_sidecar *sidecar,
+		    const struct csv_dialect *dialect,
+		    struct sidecar_header *header)
+{
+  memset (header, 0, sizeof (*header));
+  memcpy (header->magic, sidecar_magic, sizeof (sidecar_magic));
+  header->size = sidecar->size;
+  header->mtime_sec = sidecar->mtime.tv_sec;
+  header->mtime_nsec = sidecar->mtime.tv_nsec;
+  header->interval = SIDECAR_INTERVAL;
+  header->records = sidecar->records;
+  header->count = sidecar->count;
+  header->delim = dialect->delim;
+  header->quote = dialect->quote;
+  header->escape = dialect->escape;
+}
+
+/*
+ * read the sidecar at sidecar->path.  it is only used if it was written
+ * for a file of the same size, mtime and dialect.
+ */
+static bool
+csv_sidecar_load (struct csv_sidecar *sidecar,
+		  const struct csv_dialect *dialect)
+{
+  FILE *fp = fopen (sidecar->path, "rb");
+  if (fp == NULL)
+    {
+      return false;
+    }
+
+  struct sidecar_header header, expected;
+  bool valid = fread (&header, sizeof (header), 1, fp) == 1;
+  if (valid)
+    {
+      sidecar->records = header.records;
+      sidecar->count = header.count;
+      csv_sidecar_header (sidecar, dialect, &expected);
+      valid = memcmp (&header, &expected, sizeof (header)) == 0
+	&& header.records <= header.size
+	&& header.count == (header.records + SIDECAR_INTERVAL - 1)
+	/ SIDECAR_INTERVAL;
+    }
+  if (valid)
+    {
+      sidecar->capacity = MAX (sidecar->count, 1);
+      sidecar->offsets = gawk_malloc (sidecar->capacity * sizeof (uint64_t));
+      valid = fread (sidecar->offsets, sizeof (uint64_t), sidecar->count,
+		     fp) == sidecar->count;
+    }
+  for (size_t i = 0; valid && i < sidecar->count; i++)
+    {
+      valid = sidecar->offsets[i] < (uint64_t) sidecar->size
+	&& (i == 0 || sidecar->offsets[i] > sidecar->offsets[i - 1]);
+    }
+  fclose (fp);
+
+  if (!valid)
+    {
+      sidecar->count = 0;
+      sidecar->records = 0;
+    }
+  sidecar->complete = valid;
+  return valid;
+}
+
+/* write the sidecar to a temporary file and move it into place */
+static void
+csv_sidecar_save (const struct csv_sidecar *sidecar,
+		  const struct csv_dialect *dialect)
+{
+  const size_t size = strlen (sidecar->path) + 32;
+  char *temp = gawk_malloc (size);
+  snprintf (temp, size, "%s.%ld", sidecar->path, (long) getpid ());
+
+  struct sidecar_header header;
+  csv_sidecar_header (sidecar, dialect, &header);
+  FILE *fp = fopen (temp, "wb");
+  bool written = fp != NULL && fwrite (&header, sizeof (header), 1, fp) == 1
+    && fwrite (sidecar->offsets, sizeof (uint64_t), sidecar->count,
+	       fp) == sidecar->count;
+  if (fp != NULL)
+    {
+      written = fclose (fp) == 0 && written;
+    }
+  if (!written || rename (temp, sidecar->path) != 0)
+    {
+      warning (ext_id, "maga-csv: cannot write %s: %s", sidecar->path,
+	       strerror (errno));
+      unlink (temp);
+    }
+  gawk_free (temp);
+}
+
+/*
+ * with CSV_INDEX the sidecar of the file called name is loaded, or built
+ * while the file is read and saved once all of it has been.  CSV_TAIL
+ * builds one in memory if name is NULL.
+ */
+static struct csv_sidecar *
+csv_sidecar_new (struct csv_state *state, const char *name,
+		 const struct stat *sbuf)
+{
+  struct csv_sidecar *sidecar = gawk_malloc (sizeof (struct csv_sidecar));
+  sidecar->path = NULL;
+  sidecar->size = sbuf->st_size;
+  sidecar->mtime = sbuf->st_mtim;
+  sidecar->offsets = NULL;
+  sidecar->count = 0;
+  sidecar->capacity = 0;
+  sidecar->records = 0;
+  sidecar->complete = false;
+  if (name != NULL)
+    {
+      const size_t length = strlen (name);
+      sidecar->path = gawk_malloc (length + sizeof (SIDECAR_SUFFIX));
+      memcpy (sidecar->path, name, length);
+      memcpy (sidecar->path + length, SIDECAR_SUFFIX,
+	      sizeof (SIDECAR_SUFFIX));
+    }
+  state->mark = 0;
+  if (sidecar->path != NULL && csv_sidecar_load (sidecar, &state->dialect))
+    {
+      state->mark = SIZE_MAX;
+    }
+  return sidecar;
+}
+
+/* all records have been found, the offsets are complete */
+static void
+csv_sidecar_finish (struct csv_state *state)
+{
+  struct csv_sidecar *sidecar = state->sidecar;
+  sidecar->records = state->record;
+  sidecar->complete = true;
+  state->mark = SIZE_MAX;
+  if (sidecar->path != NULL)
+    {
+      csv_sidecar_save (sidecar, &state->dialect);
+    }
+}
+
+/*
+ * find all records with the scanner alone, without building rows.  its
+ * records are not counted, the pass after it counts those it walks as
+ * it would with a sidecar that was loaded.
+ */
+static void
+csv_sidecar_scan (struct csv_state *state)
+{
+  const size_t offset = state->offset;
+  const size_t record = state->record;
+  const size_t skip = state->skip;
+  const size_t records = state->stats.records;
+
+  state->skip = SIZE_MAX;
+  csv_parse_batch (state, 1);
+  csv_sidecar_finish (state);
+
+  state->offset = offset;
+  state->record = record;
+  state->skip = skip;
+  state->stats.records = records;
+  csv_batch_reset (state->batch);
+}
+
+/* continue with record number target, skipping from the closest offset */
+static void
+csv_sidecar_seek (struct csv_state *state, size_t target)
+{
+  const struct csv_sidecar *sidecar = state->sidecar;
+  if (sidecar->count > 0)
+    {
+      const size_t group = MIN (target / SIDECAR_INTERVAL,
+				sidecar->count - 1);
+      if (sidecar->offsets[group] > state->offset)
+	{
+	  state->offset = sidecar->offsets[group];
+	  state->record = group * SIDECAR_INTERVAL;
+	}
+    }
+  state->skip = target - state->record;
+}
+
+static void
+csv_sidecar_destroy (struct csv_sidecar *sidecar)
+{
+  gawk_free (sidecar->offsets);
+  gawk_free (sidecar->path);
+  gawk_free (sidecar);
+}
+
+static awk_bool_t
+csv_can_take_file (const awk_input_buf_t * iobuf)
+{
+  if (iobuf == NULL)
+    return awk_false;
+
+  return (iobuf->fd != INVALID_HANDLE);
+}
+
+/* counters of the inputs closed so far and the last one opened */
+static struct csv_stats csv_totals;
+static size_t csv_inputs;
+static const struct csv_state *csv_current;
+
+static const char *const csv_stats_names[] = {
+  "bytes", "reads", "records", "fields", "quoted_fields", "grows",
+  "queue_high_water", "read_seconds", "parse_seconds", "invalid_utf8"
+};
+
+#define CSV_STATS_COUNT (sizeof (csv_stats_names) / sizeof (char *))
+
+static void
+csv_stats_values (const struct csv_stats *stats, double *values)
+{
+  values[0] = stats->bytes;
+  values[1] = stats->reads;
+  values[2] = stats->records;
+  values[3] = stats->fields;
+  values[4] = stats->quoted;
+  values[5] = stats->grows;
+  values[6] = stats->high_water;
+  values[7] = stats->read_ns / 1e9;
+  values[8] = stats->parse_ns / 1e9;
+  values[9] = stats->invalid;
+}
+
+/* one line of name=value pairs, for MAGA_CSV_STATS */
+static void
+csv_stats_print (const char *name, const struct csv_stats *stats)
+{
+  double values[CSV_STATS_COUNT];
+  csv_stats_values (stats, values);
+  fprintf (stderr, "maga-csv: %s:", name);
+  for (size_t i = 0; i < CSV_STATS_COUNT; i++)
+    {
+      fprintf (stderr, " %s=%.15g", csv_stats_names[i], values[i]);
+    }
+  fputc ('\n', stderr);
+}
+
+static void
+csv_close (awk_input_buf_t * iobuf)
+{
+  struct csv_state *state = (struct csv_state *) iobuf->opaque;
+  if (state->pipeline != NULL)
+    {
+      csv_pipeline_stop (state);
+    }
+  else
+    {
+      csv_batch_destroy (state->batch);
+      gawk_free (state->batch);
+    }
+#ifdef MAGA_CSV_URING
+  if (state->uring != NULL)
+    {
+      csv_uring_destroy (state->uring);
+    }
+#endif
+  if (state->inflate != NULL)
+    {
+      csv_inflate_destroy (state->inflate);
+    }
+  if (state->sidecar != NULL)
+    {
+      /* a pass that read the whole file has found every record */
+      if (state->mark != SIZE_MAX && state->offset >= state->length)
+	{
+	  csv_sidecar_finish (state);
+	}
+      csv_sidecar_destroy (state->sidecar);
+    }
+  if (state->mapped)
+    {
+      munmap (state->buffer, state->capacity);
+    }
+  else
+    {
+      gawk_free (state->buffer);
+    }
+  gawk_free (state->projection.columns);
+  csv_filter_destroy (&state->filter);
+  csv_groups_destroy (&state->groups);
+  gawk_free (state->spans);
+  gawk_free (state->scratch);
+  if (state->sample != NULL)
+    {
+      csv_sample_destroy (state->sample);
+    }
+  gawk_free (state->index);
+#ifdef MAGA_CSV_WIDTHS
+  gawk_free (state->widths);
+#endif
+
+  csv_stats_add (&csv_totals, &state->stats);
+  csv_inputs++;
+  if (csv_current == state)
+    {
+      csv_current = NULL;
+    }
+  const char *print = getenv ("MAGA_CSV_STATS");
+  if (print != NULL && strcmp (print, "0") != 0)
+    {
+      csv_stats_print (iobuf->name, &state->stats);
+    }
+  gawk_free (state);
+}
+
+/* CSV_SHARD as i and count, 1 <= i <= count; false if unset or bad */
+static bool
+csv_shard_parse (size_t *i, size_t *count)
+{
+  awk_value_t value;
+  if (!sym_lookup ("CSV_SHARD", AWK_STRING, &value)
+      || value.str_value.len == 0)
+    {
+      return false;
+    }
+  const char *spec = value.str_value.str;
+  char *end;
+  const long shard = strtol (spec, &end, 10);
+  if (end != spec && *end == '/')
+    {
+      const char *next = end + 1;
+      const long shards = strtol (next, &end, 10);
+      if (end != next && *end == '\0' && shard >= 1 && shard <= shards)
+	{
+	  *i = shard;
+	  *count = shards;
+	  return true;
+	}
+    }
+  warning (ext_id, "maga-csv: CSV_SHARD must be i/n with 1 <= i <= n");
+  return false;
+}
+
+/* the numeric value of the awk variable name, 0 if it is unset */
+static double
+csv_awk_number (const char *name)
+{
+  awk_value_t value;
+  if (!sym_lookup (name, AWK_NUMBER, &value))
+    {
+      return 0;
+    }
+  return value.num_value;
+}
+
+/*
+ * the single character in the awk variable name, or fallback if it is
+ * unset or empty.  set it in BEGIN or with -v, e.g. -v CSV_DELIM='\t'.
+ */
+static char
+csv_dialect_char (const char *name, char fallback)
+{
+  awk_value_t value;
+  if (!sym_lookup (name, AWK_STRING, &value) || value.str_value.len == 0)
+    {
+      return fallback;
+    }
+  if (value.str_value.len > 1)
+    {
+      warning (ext_id, "maga-csv: only the first character of %s is used",
+	       name);
+    }
+  return value.str_value.str[0];
+}
+
+/* CSV_UTF8 as a policy, off if it is unset */
+static enum csv_utf8
+csv_utf8_policy (void)
+{
+  static const char *const names[] = { "", "pass", "replace", "reject" };
+  awk_value_t value;
+  if (!sym_lookup ("CSV_UTF8", AWK_STRING, &value)
+      || value.str_value.len == 0)
+    {
+      return UTF8_OFF;
+    }
+  for (size_t i = UTF8_PASS; i <= UTF8_REJECT; i++)
+    {
+      if (strcmp (value.str_value.str, names[i]) == 0)
+	{
+	  return i;
+	}
+    }
+  warning (ext_id, "maga-csv: CSV_UTF8 is pass, replace or reject, "
+	   "not \"%s\"", value.str_value.str);
+  return UTF8_OFF;
+}
+
+/* read CSV_DELIM, CSV_QUOTE and CSV_ESCAPE and pick a kernel for them */
+static void
+csv_dialect_init (struct csv_dialect *dialect)
+{
+  dialect->delim = csv_dialect_char ("CSV_DELIM", CSV_DELIM);
+  dialect->quote = csv_dialect_char ("CSV_QUOTE", CSV_QUOTE);
+  dialect->escape = csv_dialect_char ("CSV_ESCAPE", dialect->quote);
+
+  /* strchr also finds NUL, which pads the last block of the kernels */
+  const char *special = "\n\r";
+  if (strchr (special, dialect->delim) != NULL
+      || strchr (special, dialect->quote) != NULL
+      || strchr (special, dialect->escape) != NULL
+      || dialect->delim == dialect->quote
+      || dialect->delim == dialect->escape)
+    {
+      warning (ext_id, "maga-csv: conflicting CSV_DELIM, CSV_QUOTE or "
+	       "CSV_ESCAPE, using the defaults");
+      dialect->delim = CSV_DELIM;
+      dialect->quote = CSV_QUOTE;
+      dialect->escape = CSV_QUOTE;
+    }
+  dialect->scan = scanner_for (dialect);
+}
+
+/* the column of the first header field called name[0, len) */
+static bool
+csv_header_column (const struct csv_header *header, const char *name,
+		   size_t len, size_t *column)
+{
+  for (size_t i = 0; i < header->count; i++)
+    {
+      if (header->fields[i].length == len
+	  && memcmp (header->fields[i].text, name, len) == 0)
+	{
+	  *column = i;
+	  return true;
+	}
+    }
+  return false;
+}
+
+/* a one based column number or range like "3-7" in spec[0, len) */
+static bool
+csv_column_range (const char *spec, size_t len, size_t *first,
+		  size_t *last)
+{
+  char *end;
+  const long from = strtol (spec, &end, 10);
+  long to = from;
+  if (end == spec || from < 1)
+    {
+      return false;
+    }
+  if (*end == '-')
+    {
+      const char *next = end + 1;
+      to = strtol (next, &end, 10);
+      if (end == next || to < from)
+	{
+	  return false;
+	}
+    }
+  *first = from - 1;
+  *last = to - 1;
+  return end == spec + len;
+}
+
+/*
+ * parse a CSV_COLUMNS list like "1,5,17", "3-7,1" or, with a header,
+ * "id,price" into projection.  returns false if it is malformed.
+ */
+static bool
+csv_projection_parse (struct csv_projection *projection, const char *spec,
+		      const struct csv_header *header)
+{
+  size_t capacity = 8;
+  projection->columns = gawk_malloc (capacity * sizeof (size_t));
+  while (*spec != '\0')
+    {
+      const size_t len = strcspn (spec, ",");
+      size_t first, last;
+      if (csv_header_column (header, spec, len, &first))
+	{
+	  last = first;
+	}
+      else if (!csv_column_range (spec, len, &first, &last))
+	{
+	  return false;
+	}
+      spec += len + (spec[len] == ',');
+
+      for (size_t column = first; column <= last; column++)
+	{
+	  if (projection->count == capacity)
+	    {
+	      capacity *= 2;
+	      projection->columns =
+		gawk_realloc (projection->columns,
+			      capacity * sizeof (size_t));
+	    }
+	  projection->columns[projection->count++] = column;
+	  projection->needed = MAX (projection->needed, column + 1);
+	}
+    }
+  return true;
+}
+
+/* read CSV_COLUMNS, an unset or empty list keeps all fields */
+static void
+csv_projection_init (struct csv_projection *projection,
+		     const struct csv_header *header)
+{
+  awk_value_t value;
+  projection->columns = NULL;
+  projection->count = 0;
+  projection->needed = 0;
+  if (!sym_lookup ("CSV_COLUMNS", AWK_STRING, &value)
+      || value.str_value.len == 0)
+    {
+      return;
+    }
+
+  char *spec = gawk_malloc (value.str_value.len + 1);
+  memcpy (spec, value.str_value.str, value.str_value.len);
+  spec[value.str_value.len] = '\0';
+  if (!csv_projection_parse (projection, spec, header))
+    {
+      warning (ext_id, "maga-csv: ignoring malformed CSV_COLUMNS \"%s\"",
+	       spec);
+      gawk_free (projection->columns);
+      projection->columns = NULL;
+      projection->count = 0;
+      projection->needed = 0;
+    }
+  gawk_free (spec);
+}
+
+/*
+ * take the first record of the input as the header and split it into
+ * field names, which live in state->batch until it is reset.  the
+ * header is missing if the input is empty.
+ */
+static void
+csv_header_read (struct csv_state *state, struct csv_header *header)
+{
+  struct csv_batch *batch = state->batch;
+  header->fields = NULL;
+  header->count = 0;
+  while (row_queue_empty (batch->row_queue) && batch->error == 0
+	 && !(state->eof && state->offset >= state->length))
+    {
+      /* stop after the first record, empty lines before it are skipped */
+      state->limit = state->offset + 1;
+      batch->eof = false;
+      csv_parse_batch (state, 1);
+    }
+  state->limit = SIZE_MAX;
+  state->begin = state->offset;
+  if (row_queue_empty (batch->row_queue))
+    {
+      return;
+    }
+
+  const row_t row = row_queue_pop_front (batch->row_queue);
+  header->count = 1;
+  for (size_t i = 0; i < row.length; i++)
+    {
+      header->count += row.text[i] == RT_START;
+    }
+  header->fields = gawk_malloc (header->count * sizeof (row_t));
+  size_t field = 0;
+  size_t from = 0;
+  for (size_t i = 0; i <= row.length; i++)
+    {
+      if (i == row.length || row.text[i] == RT_START)
+	{
+	  header->fields[field].text = row.text + from;
+	  header->fields[field].length = i - from;
+	  field++;
+	  from = i + 1;
+	}
+    }
+}
+
+/* predicates registered with csv_filter(), copied to each input */
+static struct csv_predicate *csv_predicates;
+static size_t csv_predicate_count;
+
+static char *
+csv_strndup (const char *text, size_t length)
+{
+  char *copy = gawk_malloc (length + 1);
+  memcpy (copy, text, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+static void
+csv_predicate_copy (struct csv_predicate *copy,
+		    const struct csv_predicate *predicate)
+{
+  *copy = *predicate;
+  copy->name = NULL;
+  copy->values = gawk_malloc (predicate->count * sizeof (row_t));
+  for (size_t i = 0; i < predicate->count; i++)
+    {
+      copy->values[i].length = predicate->values[i].length;
+      copy->values[i].text = csv_strndup (predicate->values[i].text,
+					  predicate->values[i].length);
+    }
+}
+
+/*
+ * copy the registered predicates to filter, with column names looked up
+ * in the header.  a name the header lacks refers to a missing field.
+ */
+static void
+csv_filter_init (struct csv_filter *filter, const struct csv_header *header)
+{
+  filter->count = csv_predicate_count;
+  filter->needed = 0;
+  filter->predicates =
+    gawk_malloc (csv_predicate_count * sizeof (struct csv_predicate));
+  for (size_t i = 0; i < csv_predicate_count; i++)
+    {
+      struct csv_predicate *predicate = &filter->predicates[i];
+      csv_predicate_copy (predicate, &csv_predicates[i]);
+      const char *name = csv_predicates[i].name;
+      if (name != NULL
+	  && !csv_header_column (header, name, strlen (name),
+				 &predicate->column))
+	{
+	  warning (ext_id, "maga-csv: csv_filter: no column named %s", name);
+	  predicate->column = SIZE_MAX;
+	}
+      if (predicate->column != SIZE_MAX)
+	{
+	  filter->needed = MAX (filter->needed, predicate->column + 1);
+	}
+    }
+}
+
+/*
+ * csv_filter(column, op, value...) adds a predicate that every row of
+ * the inputs opened afterwards must pass; csv_filter() drops them all.
+ * column is a number or, with CSV_HEADER, a name.  op is "==" with one
+ * value, "prefix" with one, "range" with a low and a high number, or
+ * "in" with any number of values.  returns 1, or 0 for a bad predicate.
+ */
+static awk_value_t *
+do_csv_filter (int nargs, awk_value_t * result, struct awk_ext_func *finfo)
+{
+  awk_value_t column, op;
+  (void) finfo;
+
+  if (nargs == 0)
+    {
+      for (size_t i = 0; i < csv_predicate_count; i++)
+	{
+	  csv_predicate_destroy (&csv_predicates[i]);
+	}
+      csv_predicate_count = 0;
+      return make_number (1, result);
+    }
+  if (nargs < 3 || !get_argument (0, AWK_STRING, &column)
+      || !get_argument (1, AWK_STRING, &op))
+    {
+      warning (ext_id, "csv_filter: expected a column, an operator and "
+	       "values");
+      return make_number (0, result);
+    }
+
+  struct csv_predicate predicate;
+  memset (&predicate, 0, sizeof (predicate));
+  const char *name = op.str_value.str;
+  if (strcmp (name, "==") == 0 && nargs == 3)
+    {
+      predicate.op = PREDICATE_EQUAL;
+    }
+  else if (strcmp (name, "prefix") == 0 && nargs == 3)
+    {
+      predicate.op = PREDICATE_PREFIX;
+    }
+  else if (strcmp (name, "range") == 0 && nargs == 4)
+    {
+      predicate.op = PREDICATE_RANGE;
+    }
+  else if (strcmp (name, "in") == 0)
+    {
+      predicate.op = PREDICATE_IN;
+    }
+  else
+    {
+      warning (ext_id, "csv_filter: bad operator \"%s\" or value count",
+	       name);
+      return make_number (0, result);
+    }
+
+  size_t first, last;
+  if (csv_column_range (column.str_value.str, column.str_value.len, &first,
+			&last) && first == last)
+    {
+      predicate.column = first;
+    }
+  else
+    {
+      predicate.name = csv_strndup (column.str_value.str,
+				    column.str_value.len);
+    }
+
+  predicate.count = nargs - 2;
+  predicate.values = gawk_malloc (predicate.count * sizeof (row_t));
+  for (size_t i = 0; i < predicate.count; i++)
+    {
+      awk_value_t value;
+      if (!get_argument (i + 2, AWK_STRING, &value))
+	{
+	  value.str_value.str = "";
+	  value.str_value.len = 0;
+	}
+      predicate.values[i].length = value.str_value.len;
+      predicate.values[i].text = csv_strndup (value.str_value.str,
+					      value.str_value.len);
+    }
+  if (predicate.op == PREDICATE_RANGE)
+    {
+      predicate.low = csv_number (predicate.values[0].text,
+				  predicate.values[0].length);
+      predicate.high = csv_number (predicate.values[1].text,
+				   predicate.values[1].length);
+    }
+
+  csv_predicates = gawk_realloc (csv_predicates,
+				 (csv_predicate_count + 1)
+				 * sizeof (struct csv_predicate));
+  csv_predicates[csv_predicate_count++] = predicate;
+  return make_number (1, result);
+}
+
+/*
+ * look up the columns of the aggregations in the header and start empty
+ * groups for the input.  an aggregation whose columns the header lacks
+ * is left out.
+ */
+static void
+csv_groups_init (struct csv_groups *groups, const struct csv_header *header)
+{
+  groups->groups =
+    gawk_malloc (MAX (csv_aggregation_count, 1) * sizeof (struct csv_group));
+  groups->count = 0;
+  groups->needed = 0;
+  groups->generation = csv_aggregation_generation;
+  groups->key_size = 64;
+  groups->key = gawk_malloc (groups->key_size);
+
+  awk_value_t subsep;
+  if (!sym_lookup ("SUBSEP", AWK_STRING, &subsep))
+    {
+      make_const_string ("\034", 1, &subsep);
+    }
+  groups->subsep_length = subsep.str_value.len;
+  groups->subsep = csv_strndup (subsep.str_value.str, subsep.str_value.len);
+
+  for (size_t i = 0; i < csv_aggregation_count; i++)
+    {
+      const struct csv_aggregation *aggregation = &csv_aggregations[i];
+      struct csv_group *group = &groups->groups[groups->count];
+      struct csv_projection column = { NULL, 0, 0 };
+      group->id = i;
+      group->keys.count = 0;
+      group->keys.needed = 0;
+      if (!csv_projection_parse (&group->keys, aggregation->keys, header))
+	{
+	  warning (ext_id, "maga-csv: csv_group_by: no key columns \"%s\"",
+		   aggregation->keys);
+	  gawk_free (group->keys.columns);
+	  continue;
+	}
+      if (aggregation->column != NULL
+	  && (!csv_projection_parse (&column, aggregation->column, header)
+	      || column.count != 1))
+	{
+	  warning (ext_id, "maga-csv: csv_group_by: no value column \"%s\"",
+		   aggregation->column);
+	  gawk_free (group->keys.columns);
+	  gawk_free (column.columns);
+	  continue;
+	}
+      group->column = column.count > 0 ? column.columns[0] : SIZE_MAX;
+      gawk_free (column.columns);
+      group_table_init (&group->table);
+      groups->needed = MAX (groups->needed, MAX (group->keys.needed,
+						 column.needed));
+      groups->count++;
+    }
+}
+
+/*
+ * csv_group_by(keys, column, op...) adds an aggregation of the rows of
+ * the inputs opened afterwards and returns its number for csv_groups().
+ * keys lists the columns of the group key as CSV_COLUMNS does, "" puts
+ * all rows in one group.  column holds the values, "" for none.  ops
+ * are count, sum, min, max and mean.  csv_group_by() drops all
+ * aggregations.  returns 0 for a bad aggregation.
+ */
+static awk_value_t *
+do_csv_group_by (int nargs, awk_value_t * result,
+		 struct awk_ext_func *finfo)
+{
+  awk_value_t keys, column;
+  (void) finfo;
+
+  if (nargs == 0)
+    {
+      for (size_t i = 0; i < csv_aggregation_count; i++)
+	{
+	  gawk_free (csv_aggregations[i].keys);
+	  gawk_free (csv_aggregations[i].column);
+	  group_table_destroy (&csv_aggregations[i].table);
+	}
+      csv_aggregation_count = 0;
+      csv_aggregation_generation++;
+      return make_number (1, result);
+    }
+  if (nargs < 3 || !get_argument (0, AWK_STRING, &keys)
+      || !get_argument (1, AWK_STRING, &column))
+    {
+      warning (ext_id, "csv_group_by: expected keys, a column and "
+	       "operations");
+      return make_number (0, result);
+    }
+
+  unsigned ops = 0;
+  for (int i = 2; i < nargs; i++)
+    {
+      awk_value_t op;
+      size_t k = 0;
+      if (get_argument (i, AWK_STRING, &op))
+	{
+	  while (k < GROUP_OPS && strcmp (op.str_value.str, csv_group_ops[k]))
+	    {
+	      k++;
+	    }
+	}
+      if (k == GROUP_OPS || (k > 0 && column.str_value.len == 0))
+	{
+	  warning (ext_id, "csv_group_by: bad operation \"%s\"",
+		   k < GROUP_OPS ? op.str_value.str : "");
+	  return make_number (0, result);
+	}
+      ops |= 1u << k;
+    }
+
+  struct csv_aggregation aggregation;
+  aggregation.keys = csv_strndup (keys.str_value.str, keys.str_value.len);
+  aggregation.column = column.str_value.len == 0 ? NULL
+    : csv_strndup (column.str_value.str, column.str_value.len);
+  aggregation.ops = ops;
+  group_table_init (&aggregation.table);
+
+  csv_aggregations = gawk_realloc (csv_aggregations,
+				   (csv_aggregation_count + 1)
+				   * sizeof (struct csv_aggregation));
+  csv_aggregations[csv_aggregation_count++] = aggregation;
+  return make_number (csv_aggregation_count, result);
+}
+
+/*
+ * csv_groups(n, array) fills array[key, op] with the results of the
+ * n-th aggregation over the inputs closed so far and returns the number
+ * of groups, or -1 if there is no such aggregation.
+ */
+static awk_value_t *
+do_csv_groups (int nargs, awk_value_t * result, struct awk_ext_func *finfo)
+{
+  awk_value_t number, array;
+  (void) finfo;
+
+  if (nargs != 2 || !get_argument (0, AWK_NUMBER, &number)
+      || !get_argument (1, AWK_ARRAY, &array)
+      || number.num_value < 1 || number.num_value > csv_aggregation_count)
+    {
+      warning (ext_id, "csv_groups: expected an aggregation and an array");
+      return make_number (-1, result);
+    }
+  clear_array (array.array_cookie);
+
+  awk_value_t subsep;
+  if (!sym_lookup ("SUBSEP", AWK_STRING, &subsep))
+    {
+      make_const_string ("\034", 1, &subsep);
+    }
+  const struct csv_aggregation *aggregation =
+    &csv_aggregations[(size_t) number.num_value - 1];
+  const struct group_table *table = &aggregation->table;
+  size_t size = 64;
+  char *key = gawk_malloc (size);
+
+  for (size_t i = 0; i < table->count; i++)
+    {
+      const struct group_entry *entry = &table->entries[i];
+      const double values[GROUP_OPS] = {
+	entry->count, entry->sum, entry->min, entry->max,
+	entry->sum / entry->count
+      };
+      for (size_t k = 0; k < GROUP_OPS; k++)
+	{
+	  if (!(aggregation->ops & (1u << k)))
+	    {
+	      continue;
+	    }
+	  const size_t length = entry->length + subsep.str_value.len
+	    + strlen (csv_group_ops[k]);
+	  if (size < length)
+	    {
+	      size = length;
+	      key = gawk_realloc (key, size);
+	    }
+	  memcpy (key, entry->key, entry->length);
+	  memcpy (key + entry->length, subsep.str_value.str,
+		  subsep.str_value.len);
+	  memcpy (key + entry->length + subsep.str_value.len,
+		  csv_group_ops[k], strlen (csv_group_ops[k]));
+	  awk_value_t index, value;
+	  make_const_string (key, length, &index);
+	  make_number (values[k], &value);
+	  set_array_element (array.array_cookie, &index, &value);
+	}
+    }
+  gawk_free (key);
+  return make_number (table->count, result);
+}
+
+/* the awk array called name, created or emptied */
+static awk_array_t
+csv_array (const char *name)
+{
+  awk_value_t value;
+  if (sym_lookup (name, AWK_ARRAY, &value))
+    {
+      clear_array (value.array_cookie);
+      return value.array_cookie;
+    }
+  value.val_type = AWK_ARRAY;
+  value.array_cookie = create_array ();
+  if (!sym_update (name, &value))
+    {
+      warning (ext_id, "maga-csv: cannot create array %s", name);
+      return NULL;
+    }
+  return value.array_cookie;
+}
+
+/* array[kind, name] = value for each counter, kind is "input" or "total" */
+static void
+csv_stats_publish (awk_array_t array, const char *kind,
+		   const struct csv_stats *stats, size_t inputs)
+{
+  awk_value_t subsep;
+  if (!sym_lookup ("SUBSEP", AWK_STRING, &subsep))
+    {
+      make_const_string ("\034", 1, &subsep);
+    }
+
+  double values[CSV_STATS_COUNT + 1];
+  csv_stats_values (stats, values);
+  values[CSV_STATS_COUNT] = inputs;
+  for (size_t i = 0; i <= CSV_STATS_COUNT; i++)
+    {
+      const char *name = i < CSV_STATS_COUNT ? csv_stats_names[i] : "inputs";
+      char key[64];
+      const int length = snprintf (key, sizeof (key), "%s%.*s%s", kind,
+				   (int) subsep.str_value.len,
+				   subsep.str_value.str, name);
+      awk_value_t index, value;
+      make_const_string (key, MIN ((size_t) length, sizeof (key) - 1),
+			 &index);
+      make_number (values[i], &value);
+      set_array_element (array, &index, &value);
+    }
+}
+
+/*
+ * csv_stats(array) fills array["input", name] with the counters of the
+ * input opened last, if it is still open, and array["total", name] with
+ * those of all inputs so far.  returns 1, or 0 if array is not one.
+ */
+static awk_value_t *
+do_csv_stats (int nargs, awk_value_t * result, struct awk_ext_func *finfo)
+{
+  awk_value_t array;
+  (void) finfo;
+
+  if (nargs != 1 || !get_argument (0, AWK_ARRAY, &array))
+    {
+      warning (ext_id, "csv_stats: expected an array");
+      return make_number (0, result);
+    }
+  clear_array (array.array_cookie);
+
+  struct csv_stats input;
+  memset (&input, 0, sizeof (input));
+  if (csv_current != NULL)
+    {
+      csv_input_stats (csv_current, &input);
+    }
+  struct csv_stats total = csv_totals;
+  csv_stats_add (&total, &input);
+  csv_stats_publish (array.array_cookie, "input", &input,
+		     csv_current != NULL);
+  csv_stats_publish (array.array_cookie, "total", &total,
+		     csv_inputs + (csv_current != NULL));
+  return make_number (1, result);
+}
+
+/*
+ * publish the names of the fields gawk will see: CSV_COLUMN[name] is the
+ * field number of name and CSV_NAME[number] the name of a field.  with
+ * a projection only its fields are named, in its order.
+ */
+static void
+csv_header_publish (const struct csv_header *header,
+		    const struct csv_projection *projection)
+{
+  awk_array_t columns = csv_array ("CSV_COLUMN");
+  awk_array_t names = csv_array ("CSV_NAME");
+  if (columns == NULL || names == NULL)
+    {
+      return;
+    }
+
+  const size_t count =
+    projection->count > 0 ? projection->count : header->count;
+  for (size_t i = count; i > 0; i--)
+    {
+      /* walk backwards so the first of duplicate names wins */
+      const size_t column =
+	projection->count > 0 ? projection->columns[i - 1] : i - 1;
+      if (column >= header->count)
+	{
+	  continue;
+	}
+      const row_t *field = &header->fields[column];
+      awk_value_t index, value;
+      make_const_string (field->text, field->length, &index);
+      make_number (i, &value);
+      set_array_element (columns, &index, &value);
+      make_number (i, &index);
+      make_const_string (field->text, field->length, &value);
+      set_array_element (names, &index, &value);
+    }
+}
+
+static awk_bool_t
+csv_take_control_of (awk_input_buf_t * iobuf)
+{
+  // we would set the FS to 31 here, but gawk doesn't allow it. qq
+  if (iobuf->fd == INVALID_HANDLE)
+    {
+      return 1;
+    }
+
+  struct csv_state *state = gawk_malloc (sizeof (struct csv_state));
+  state->fd = iobuf->fd;
+  // setup buffer
+  state->length = 0;
+  state->offset = 0;
+  state->limit = SIZE_MAX;
+  state->begin = 0;
+  state->eof = false;
+  state->mapped = false;
+  state->stream = false;
+  state->uring = NULL;
+  state->inflate = NULL;
+#ifdef MAGA_CSV_WIDTHS
+  state->widths = NULL;
+  state->widths_size = 0;
+#endif
+  memset (&state->stats, 0, sizeof (state->stats));
+
+  // decompress gzip and zstd input on a helper thread
+  unsigned char magic[4];
+  size_t consumed;
+  const char *decompress = getenv ("MAGA_CSV_DECOMPRESS");
+  const enum csv_codec codec =
+    csv_detect_codec (state->fd, &iobuf->sbuf, magic, &consumed);
+  if (codec != CODEC_NONE
+      && (decompress == NULL || strcmp (decompress, "0") != 0))
+    {
+      state->inflate = csv_inflate_new (state->fd, codec, magic, consumed);
+    }
+
+  if (state->inflate != NULL || !csv_map_file (state, &iobuf->sbuf))
+    {
+      state->capacity = READ_SZ;
+      state->buffer = gawk_malloc (state->capacity);
+      if (state->inflate == NULL)
+	{
+	  // bytes read from a pipe to look for magic are input
+	  memcpy (state->buffer, magic, consumed);
+	  state->length = consumed;
+	}
+#ifdef MAGA_CSV_URING
+      // keep reads of an unmapped file in flight
+      const char *uring = getenv ("MAGA_CSV_URING");
+      if (state->inflate == NULL && S_ISREG (iobuf->sbuf.st_mode)
+	  && (uring == NULL || strcmp (uring, "0") != 0))
+	{
+	  state->uring = csv_uring_new (state->fd);
+	}
+#endif
+      // pipes and sockets are read until they run dry
+      state->stream = state->inflate == NULL
+	&& (S_ISFIFO (iobuf->sbuf.st_mode) || S_ISSOCK (iobuf->sbuf.st_mode));
+    }
+  if (S_ISFIFO (iobuf->sbuf.st_mode))
+    {
+      csv_pipe_grow (state->fd);
+    }
+  // setup scanner index
+  state->window = SCAN_WINDOW;
+  state->index = gawk_malloc (state->window * sizeof (uint32_t));
+  state->paused = SIZE_MAX;
+  // a batch holds at most MAGA_CSV_QUEUE_ROWS rows or QUEUE_BYTES of text
+  const char *queue_rows = getenv ("MAGA_CSV_QUEUE_ROWS");
+  const char *queue_bytes = getenv ("MAGA_CSV_QUEUE_BYTES");
+  state->queue_rows = queue_rows != NULL && atol (queue_rows) > 0
+    ? (size_t) atol (queue_rows) : QUEUE_ROWS;
+  state->queue_bytes = queue_bytes != NULL && atol (queue_bytes) > 0
+    ? (size_t) atol (queue_bytes) : QUEUE_BYTES;
+  state->borrow = true;
+  csv_dialect_init (&state->dialect);
+  /* the header is never projected or filtered */
+  state->projection.count = 0;
+  state->filter.count = 0;
+  state->groups.count = 0;
+  state->discard = false;
+  state->utf8 = UTF8_OFF;
+  state->needed = 0;
+  state->spans = NULL;
+  state->scratch = NULL;
+  state->scratch_size = 0;
+  state->skip = 0;
+  state->rows_left = SIZE_MAX;
+  state->sample = NULL;
+  state->sidecar = NULL;
+  state->record = 0;
+  state->mark = SIZE_MAX;
+  state->pipeline = NULL;
+
+  // setup row_queue and row storage
+  struct csv_batch *batch =
+    csv_batch_new (gawk_malloc (sizeof (struct csv_batch)));
+  state->batch = batch;
+
+  // a UTF-8 byte order mark is not part of the first record; read on
+  // only while what has arrived may still be one
+  while (!state->mapped && state->length < 3 && !state->eof
+	 && memcmp (state->buffer, "\xef\xbb\xbf", state->length) == 0
+	 && csv_fill (state) == 0)
+    {
+    }
+  if (state->length >= 3 && memcmp (state->buffer, "\xef\xbb\xbf", 3) == 0)
+    {
+      state->offset = 3;
+      state->begin = 3;
+    }
+
+  // CSV_INDEX keeps record offsets of mapped files in a sidecar
+  const bool indexed = csv_awk_number ("CSV_INDEX") != 0;
+  const double tail = csv_awk_number ("CSV_TAIL");
+  if (state->mapped && (indexed || tail > 0))
+    {
+      state->sidecar = csv_sidecar_new (state, indexed ? iobuf->name : NULL,
+					&iobuf->sbuf);
+    }
+
+  // with CSV_HEADER set the first record names the columns
+  struct csv_header header = { NULL, 0 };
+  const bool has_header = csv_awk_number ("CSV_HEADER") != 0;
+  if (has_header)
+    {
+      csv_header_read (state, &header);
+    }
+  csv_projection_init (&state->projection, &header);
+  csv_filter_init (&state->filter, &header);
+  csv_groups_init (&state->groups, &header);
+  state->utf8 = csv_utf8_policy ();
+  if (has_header)
+    {
+      csv_header_publish (&header, &state->projection);
+      gawk_free (header.fields);
+    }
+  state->needed = MAX (state->projection.needed, state->filter.needed);
+  state->needed = MAX (state->needed, state->groups.needed);
+  // with CSV_DISCARD rows only feed the aggregations
+  state->discard = csv_awk_number ("CSV_DISCARD") != 0;
+  state->spans = gawk_malloc (state->needed * sizeof (struct field_span));
+
+  // CSV_SKIP rows, then pass at most CSV_LIMIT or sample CSV_SAMPLE
+  const double skip = csv_awk_number ("CSV_SKIP");
+  const double limit = csv_awk_number ("CSV_LIMIT");
+  const double sample = csv_awk_number ("CSV_SAMPLE");
+  state->skip = skip > 0 ? (size_t) skip : 0;
+  state->rows_left = limit > 0 ? (size_t) limit : SIZE_MAX;
+  // CSV_SHARD=i/n takes the i-th of n byte ranges of a mapped file
+  size_t shard = 0;
+  size_t shards = 0;
+  if (csv_shard_parse (&shard, &shards) && !state->mapped)
+    {
+      warning (ext_id, "maga-csv: CSV_SHARD needs a mapped file");
+      shards = 0;
+    }
+  if (shards > 0)
+    {
+      csv_shard (state, shard, shards);
+      if (state->sidecar != NULL && !state->sidecar->complete)
+	{
+	  // records of a shard cannot be numbered
+	  csv_sidecar_destroy (state->sidecar);
+	  state->sidecar = NULL;
+	  state->mark = SIZE_MAX;
+	}
+    }
+  if (tail > 0 && shards > 0)
+    {
+      warning (ext_id, "maga-csv: CSV_TAIL is ignored with CSV_SHARD");
+    }
+  else if (tail > 0 && state->sidecar == NULL)
+    {
+      warning (ext_id, "maga-csv: CSV_TAIL needs a mapped file");
+    }
+  else if (state->sidecar != NULL && shards == 0)
+    {
+      // CSV_TAIL rows are the last ones, all records must be known
+      if (tail > 0 && !state->sidecar->complete)
+	{
+	  csv_sidecar_scan (state);
+	}
+      size_t target = state->record + state->skip;
+      if (tail > 0 && state->sidecar->records > (size_t) tail)
+	{
+	  target = MAX (target, state->sidecar->records - (size_t) tail);
+	}
+      if (state->sidecar->complete)
+	{
+	  csv_sidecar_seek (state, target);
+	  state->begin = state->offset;
+	}
+    }
+  if (sample > 0)
+    {
+      const double seed = csv_awk_number ("CSV_SEED");
+      state->sample = csv_sample_new ((size_t) sample, seed != 0
+				      ? (uint64_t) seed
+				      : (uint64_t) time (NULL) ^ getpid ());
+    }
+  csv_batch_reset (batch);
+  state->batch = NULL;
+
+  iobuf->opaque = state;
+  iobuf->get_record = csv_get_record;
+  csv_current = state;
+  iobuf->close_func = csv_close;
+
+  // parse on a worker thread if asked to
+  const char *threads = getenv ("MAGA_CSV_THREADS");
+  if (threads != NULL && atoi (threads) > 0
+      && csv_pipeline_start (state, atoi (threads)))
+    {
+      iobuf->get_record = state->pipeline->segments > 0
+	? csv_segments_get_record : csv_pipeline_get_record;
+    }
+  else
+    {
+      state->batch = batch;
+      batch = NULL;
+    }
+  if (batch != NULL)
+    {
+      csv_batch_destroy (batch);
+      gawk_free (batch);
+    }
+  return awk_true;
+}
+
+static awk_input_parser_t csv_parser = {
+  .name = "csv",
+  .can_take_file = csv_can_take_file,
+  .take_control_of = csv_take_control_of,
+};
+
+/* a file read by csv_read_batch, open between calls */
+struct csv_reader
+{
+  char *name;
+  awk_input_buf_t iobuf;
+  bool eof;
+  struct csv_reader *next;
+};
+
+static struct csv_reader *csv_readers;
+
+/* the reader of name, opened with the current settings if it is new */
+static struct csv_reader *
+csv_reader_open (const char *name)
+{
+  for (struct csv_reader *reader = csv_readers; reader != NULL;
+       reader = reader->next)
+    {
+      if (strcmp (reader->name, name) == 0)
+	{
+	  return reader;
+	}
+    }
+
+  const int fd = open (name, O_RDONLY);
+  if (fd < 0)
+    {
+      warning (ext_id, "csv_read_batch: cannot open %s: %s", name,
+	       strerror (errno));
+      return NULL;
+    }
+  struct csv_reader *reader = gawk_calloc (1, sizeof (struct csv_reader));
+  reader->name = csv_strndup (name, strlen (name));
+  reader->iobuf.name = reader->name;
+  reader->iobuf.fd = fd;
+  fstat (fd, &reader->iobuf.sbuf);
+  // the input gawk is reading stays the one csv_stats reports
+  const struct csv_state *current = csv_current;
+  csv_take_control_of (&reader->iobuf);
+  csv_current = current;
+  reader->next = csv_readers;
+  csv_readers = reader;
+  return reader;
+}
+
+static void
+csv_reader_close (struct csv_reader *reader)
+{
+  struct csv_reader **link = &csv_readers;
+  while (*link != reader)
+    {
+      link = &(*link)->next;
+    }
+  *link = reader->next;
+  if (!reader->eof)
+    {
+      reader->iobuf.close_func (&reader->iobuf);
+    }
+  close (reader->iobuf.fd);
+  gawk_free (reader->name);
+  gawk_free (reader);
+}
+
+/*
+ * csv_read_batch(file, array [, n]) parses the next n rows of file, or
+ * all that are left, into array[row, column] with rows counted from 1
+ * in each call.  the file is parsed like an input of gawk with the
+ * settings at the first call: dialect, CSV_HEADER, CSV_COLUMNS,
+ * csv_filter() and so on.  returns the number of rows, 0 once at the
+ * end, after which the file is read from the start again, or -1.
+ */
+static awk_value_t *
+do_csv_read_batch (int nargs, awk_value_t * result,
+		   struct awk_ext_func *finfo)
+{
+  awk_value_t file, array, count;
+  (void) finfo;
+
+  if (nargs < 2 || nargs > 3 || !get_argument (0, AWK_STRING, &file)
+      || !get_argument (1, AWK_ARRAY, &array)
+      || (nargs == 3 && !get_argument (2, AWK_NUMBER, &count)))
+    {
+      warning (ext_id, "csv_read_batch: expected a file, an array and "
+	       "a row count");
+      return make_number (-1, result);
+    }
+  clear_array (array.array_cookie);
+  const size_t rows = nargs == 3 && count.num_value > 0
+    ? (size_t) count.num_value : SIZE_MAX;
+
+  struct csv_reader *reader = csv_reader_open (file.str_value.str);
+  if (reader == NULL)
+    {
+      return make_number (-1, result);
+    }
+  if (reader->eof)
+    {
+      csv_reader_close (reader);
+      return make_number (0, result);
+    }
+
+  awk_value_t subsep;
+  if (!sym_lookup ("SUBSEP", AWK_STRING, &subsep))
+    {
+      make_const_string ("\034", 1, &subsep);
+    }
+  awk_input_buf_t *iobuf = &reader->iobuf;
+  size_t row = 0;
+  while (row < rows)
+    {
+      char *text, *rt_start;
+      size_t rt_len;
+      int error = 0;
+#ifdef MAGA_CSV_WIDTHS
+      const awk_fieldwidth_info_t *widths = NULL;
+      const int length = iobuf->get_record (&text, iobuf, &error, &rt_start,
+					    &rt_len, &widths);
+#else
+      const int length =
+	iobuf->get_record (&text, iobuf, &error, &rt_start, &rt_len);
+#endif
+      if (length == EOF)
+	{
+	  if (error != 0)
+	    {
+	      warning (ext_id, "csv_read_batch: %s: %s", reader->name,
+		       strerror (error));
+	    }
+	  iobuf->close_func (iobuf);
+	  reader->eof = true;
+	  break;
+	}
+      row++;
+
+      // fields become strings that look like numbers to awk, as $n do
+      char key[64];
+      const int prefix = MIN (snprintf (key, sizeof (key) - 24, "%zu%.*s",
+					row, (int) subsep.str_value.len,
+					subsep.str_value.str),
+			      (int) sizeof (key) - 25);
+      // a record of one empty field still sets arr[row, 1], like $1
+      size_t column = 0;
+      const char *end = text + length;
+      for (const char *field = text; field <= end;)
+	{
+#ifdef MAGA_CSV_WIDTHS
+	  // fields may hold RT_START, their widths tell where they end
+	  if (column == widths->nf)
+	    {
+	      break;
+	    }
+	  const char *next = field + widths->fields[column].len;
+#else
+	  const char *next = memchr (field, RT_START, end - field);
+	  if (next == NULL)
+	    {
+	      next = end;
+	    }
+#endif
+	  // the column number, written backwards
+	  char digits[24];
+	  size_t digit = sizeof (digits);
+	  for (size_t number = ++column; number > 0; number /= 10)
+	    {
+	      digits[--digit] = '0' + number % 10;
+	    }
+	  memcpy (key + prefix, digits + digit, sizeof (digits) - digit);
+	  awk_value_t index, value;
+	  make_const_string (key, prefix + sizeof (digits) - digit, &index);
+	  make_const_user_input (field, next - field, &value);
+	  set_array_element (array.array_cookie, &index, &value);
+	  field = next + 1;
+	}
+    }
+  if (reader->eof && row == 0)
+    {
+      csv_reader_close (reader);
+    }
+  return make_number (row, result);
+}
+
+/*
+ * output wrapper that turns records of RT_START separated fields back
+ * into CSV.  gawk hands over a record in several writes (each field,
+ * OFS, ORS), so the bytes of the current field are collected in the
+ * buffer until its end shows whether it must be quoted.  records end at
+ * the first byte of ORS as it was when the file was opened and are
+ * written with a \n.
+ */
+struct csv_output
+{
+  struct csv_dialect dialect;
+  char *record_end;		/* ORS when the file was opened */
+  size_t record_end_length;
+  char *buffer;
+  size_t capacity;
+  size_t length;
+  size_t field;			/* start of the current field in buffer */
+  bool delimited;		/* the current record has several fields */
+  bool after_field;		/* the last write was a field, not OFS */
+  bool error;
+};
+
+/* whether a field must be quoted, 16 bytes at a time where possible */
+static bool
+field_needs_quotes (const struct csv_dialect *dialect, const char *text,
+		    size_t length)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i delim = _mm_set1_epi8 (dialect->delim);
+  const __m128i quote = _mm_set1_epi8 (dialect->quote);
+  const __m128i escape = _mm_set1_epi8 (dialect->escape);
+  const __m128i cr = _mm_set1_epi8 ('\r');
+  const __m128i lf = _mm_set1_epi8 ('\n');
+  for (; i + 16 <= length; i += 16)
+    {
+      const __m128i v = _mm_loadu_si128 ((const __m128i *) (text + i));
+      const __m128i hits =
+	_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, delim),
+				    _mm_cmpeq_epi8 (v, quote)),
+		      _mm_or_si128 (_mm_cmpeq_epi8 (v, escape),
+				    _mm_or_si128 (_mm_cmpeq_epi8 (v, cr),
+						  _mm_cmpeq_epi8 (v, lf))));
+      if (_mm_movemask_epi8 (hits) != 0)
+	{
+	  return true;
+	}
+    }
+#endif
+  for (; i < length; i++)
+    {
+      const char c = text[i];
+      if (c == dialect->delim || c == dialect->quote || c == dialect->escape
+	  || c == '\r' || c == '\n')
+	{
+	  return true;
+	}
+    }
+  return false;
+}
+
+/*
+ * make room for size more bytes.  everything before the current field
+ * is written out first, the buffer only grows for a huge field.
+ */
+static void
+csv_output_reserve (struct csv_output *out, FILE * fp, size_t size)
+{
+  if (out->length + size <= out->capacity)
+    {
+      return;
+    }
+  if (out->field > 0)
+    {
+      if (fwrite (out->buffer, 1, out->field, fp) != out->field)
+	{
+	  out->error = true;
+	}
+      memmove (out->buffer, out->buffer + out->field,
+	       out->length - out->field);
+      out->length -= out->field;
+      out->field = 0;
+    }
+  if (out->length + size > out->capacity)
+    {
+      out->capacity = MAX (2 * out->capacity, out->length + size);
+      out->buffer = gawk_realloc (out->buffer, out->capacity);
+    }
+}
+
+/* quote the field at the end of the buffer in place if it needs it */
+static void
+csv_output_end_field (struct csv_output *out, FILE * fp)
+{
+  const struct csv_dialect *dialect = &out->dialect;
+  size_t length = out->length - out->field;
+  if (!field_needs_quotes (dialect, out->buffer + out->field, length))
+    {
+      return;
+    }
+
+  size_t escapes = 0;
+  for (size_t i = out->field; i < out->length; i++)
+    {
+      escapes += out->buffer[i] == dialect->quote
+	|| out->buffer[i] == dialect->escape;
+    }
+  csv_output_reserve (out, fp, escapes + 2);
+
+  /* walk backwards so every byte moves only once */
+  const char *from = out->buffer + out->field + length;
+  char *to = out->buffer + out->field + length + escapes + 2;
+  *--to = dialect->quote;
+  while (length-- > 0)
+    {
+      const char c = *--from;
+      *--to = c;
+      if (c == dialect->quote || c == dialect->escape)
+	{
+	  *--to = dialect->escape;
+	}
+    }
+  *--to = dialect->quote;
+  out->length += escapes + 2;
+}
+
+/*
+ * print writes each field, OFS and ORS with writes of their own, an
+ * empty field as well, so a write after OFS or after the end of a
+ * record is always a field, even if it equals ORS.  a write of ORS
+ * right after a field ends the record.  any other line break is part
+ * of a field and gets the field quoted.
+ */
+static size_t
+csv_output_write (const void *data, size_t size, size_t count, FILE * fp,
+		  void *opaque)
+{
+  struct csv_output *out = (struct csv_output *) opaque;
+  const char *bytes = data;
+  const size_t total = size * count;
+
+  if (out->after_field && total > 0 && total == out->record_end_length
+      && memcmp (bytes, out->record_end, total) == 0)
+    {
+      csv_output_end_field (out, fp);
+      csv_output_reserve (out, fp, 3);
+      if (!out->delimited && out->length == out->field)
+	{
+	  /* an empty line would be skipped when read back */
+	  out->buffer[out->length++] = out->dialect.quote;
+	  out->buffer[out->length++] = out->dialect.quote;
+	}
+      out->buffer[out->length++] = '\n';
+      out->delimited = false;
+      out->after_field = false;
+      out->field = out->length;
+      return out->error ? 0 : count;
+    }
+  out->after_field = total == 0 || bytes[total - 1] != RT_START;
+
+  size_t from = 0;
+  for (;;)
+    {
+      const char *next = memchr (bytes + from, RT_START, total - from);
+      const size_t at = next != NULL ? (size_t) (next - bytes) : total;
+      csv_output_reserve (out, fp, at - from + 1);
+      memcpy (out->buffer + out->length, bytes + from, at - from);
+      out->length += at - from;
+      if (at == total)
+	{
+	  break;
+	}
+      csv_output_end_field (out, fp);
+      csv_output_reserve (out, fp, 1);
+      out->buffer[out->length++] = out->dialect.delim;
+      out->delimited = true;
+      out->field = out->length;
+      from = at + 1;
+    }
+  return out->error ? 0 : count;
+}
+
+/* write out all complete fields, a partial one waits for its end */
+static int
+csv_output_flush (FILE * fp, void *opaque)
+{
+  struct csv_output *out = (struct csv_output *) opaque;
+  if (out->field > 0)
+    {
+      if (fwrite (out->buffer, 1, out->field, fp) != out->field)
+	{
+	  out->error = true;
+	}
+      memmove (out->buffer, out->buffer + out->field,
+	       out->length - out->field);
+      out->length -= out->field;
+      out->field = 0;
+    }
+  return fflush (fp) != 0 || out->error ? EOF : 0;
+}
+
+static int
+csv_output_error (FILE * fp, void *opaque)
+{
+  struct csv_output *out = (struct csv_output *) opaque;
+  return out->error || ferror (fp);
+}
+
+static int
+csv_output_close (FILE * fp, void *opaque)
+{
+  struct csv_output *out = (struct csv_output *) opaque;
+  if (out->length > out->field)
+    {
+      /* the last record had no ORS */
+      csv_output_end_field (out, fp);
+      out->field = out->length;
+    }
+  int ret = csv_output_flush (fp, opaque);
+  if (fclose (fp) != 0)
+    {
+      ret = EOF;
+    }
+  gawk_free (out->buffer);
+  gawk_free (out->record_end);
+  gawk_free (out);
+  return ret;
+}
+
+/* CSV_OUTPUT=1 converts every file written with print > file */
+static awk_bool_t
+csv_output_can_take_file (const awk_output_buf_t * outbuf)
+{
+  return outbuf != NULL && csv_awk_number ("CSV_OUTPUT") != 0;
+}
+
+static awk_bool_t
+csv_output_take_control_of (awk_output_buf_t * outbuf)
+{
+  struct csv_output *out = gawk_malloc (sizeof (struct csv_output));
+  csv_dialect_init (&out->dialect);
+  awk_value_t ors;
+  if (sym_lookup ("ORS", AWK_STRING, &ors))
+    {
+      out->record_end = csv_strndup (ors.str_value.str, ors.str_value.len);
+      out->record_end_length = ors.str_value.len;
+    }
+  else
+    {
+      out->record_end = csv_strndup ("\n", 1);
+      out->record_end_length = 1;
+    }
+  out->capacity = OUTPUT_SZ;
+  out->buffer = gawk_malloc (out->capacity);
+  out->length = 0;
+  out->field = 0;
+  out->delimited = false;
+  out->after_field = false;
+  out->error = false;
+
+  outbuf->opaque = out;
+  outbuf->gawk_fwrite = csv_output_write;
+  outbuf->gawk_fflush = csv_output_flush;
+  outbuf->gawk_ferror = csv_output_error;
+  outbuf->gawk_fclose = csv_output_close;
+  outbuf->redirected = awk_true;
+  return awk_true;
+}
+
+static awk_output_wrapper_t csv_output_wrapper = {
+  .name = "csv",
+  .can_take_file = csv_output_can_take_file,
+  .take_control_of = csv_output_take_control_of,
 };
 
 static awk_bool_t
 init_csv (void)
 {
+  scanner_select ();
   register_input_parser (&csv_parser);
+  register_output_wrapper (&csv_output_wrapper);
   return 1;
 }
 
 static awk_bool_t (*init_func) (void) = init_csv;
 
 static awk_ext_func_t func_table[] = {
+  {"csv_filter", do_csv_filter, 0, 0, awk_true, NULL},
+  {"csv_stats", do_csv_stats, 1, 1, awk_false, NULL},
+  {"csv_group_by", do_csv_group_by, 0, 0, awk_true, NULL},
+  {"csv_groups", do_csv_groups, 2, 2, awk_false, NULL},
+  {"csv_read_batch", do_csv_read_batch, 3, 2, awk_false, NULL},
   {NULL, NULL, 0, 0, awk_false, NULL}
 };
 